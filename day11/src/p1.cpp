@@ -1,6 +1,9 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <cstring>
-#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -8,103 +11,102 @@
 #include <map>
 #include <memory>
 #include <optional>
-#include <set>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-class OperationBase
+enum OPERATION_TYPE
 {
-    public:
-    OperationBase()
-    {
-    }
-    virtual unsigned long operator()(unsigned long old) const = 0;
-    virtual std::string string(void) const = 0;
-    virtual unsigned long val(void) const = 0;
+    OPERATION_MULTIPLY,
+    OPERATION_ADD,
+    OPERATION_SQUARED
 };
 
-class OperationMultiply : public OperationBase
+// The new worry level calculation, held by value and dispatched with a
+// switch which inlines into the callers' loops
+class Operation
 {
-    public: 
-    OperationMultiply(const unsigned long val)
-    : val_(val)
+    public:
+    Operation(const OPERATION_TYPE type = OPERATION_SQUARED, const unsigned long val = 0)
+    : type_(type)
+    , val_(val)
     { }
 
-    unsigned long operator()(unsigned long old) const override{
-        return val_ * old;
-    }
-    std::string string(void) const override {
-        return std::string("is multiplied");
+    unsigned long operator()(const unsigned long old) const {
+        switch (type_)
+        {
+        case OPERATION_MULTIPLY:
+            return val_ * old;
+        case OPERATION_ADD:
+            return val_ + old;
+        case OPERATION_SQUARED:
+            return old * old;
+        }
+        return old;
     }
-    unsigned long val(void) const override {
-        return val_;
+    // Apply to a whole batch of items in place. The switch is hoisted out
+    // of the loops so each one is a single vectorizable operation.
+    void apply(std::vector<unsigned long> &items) const {
+        switch (type_)
+        {
+        case OPERATION_MULTIPLY:
+            for (auto &item : items)
+            {
+                item *= val_;
+            }
+            break;
+        case OPERATION_ADD:
+            for (auto &item : items)
+            {
+                item += val_;
+            }
+            break;
+        case OPERATION_SQUARED:
+            for (auto &item : items)
+            {
+                item *= item;
+            }
+            break;
+        }
     }
-
-    private:
-    unsigned long val_;
-};
-
-class OperationAdd : public OperationBase
-{
-    public: 
-    OperationAdd(const unsigned long val)
-    : val_(val)
-    { }
-
-    unsigned long operator()(unsigned long old) const override{
-        return val_ + old;
+    std::string string(void) const {
+        switch (type_)
+        {
+        case OPERATION_MULTIPLY:
+            return std::string("is multiplied");
+        case OPERATION_ADD:
+            return std::string("increases");
+        case OPERATION_SQUARED:
+            return std::string("squared");
+        }
+        return std::string();
     }
-    std::string string(void) const override {
-        return std::string("increases");
+    OPERATION_TYPE type(void) const {
+        return type_;
     }
-    unsigned long val(void) const override {
+    unsigned long val(void) const {
         return val_;
     }
-    private:
-    unsigned long val_;
-};
 
-class OperationSquared : public OperationBase
-{
-    public: 
-    OperationSquared() 
-    { }
-
-    unsigned long operator()(unsigned long old) const override{
-        return old * old;
-    }
-    std::string string(void) const override {
-        return std::string("squared");
-    }
-    unsigned long val(void) const override {
-        return 0;
-    }
     private:
+    OPERATION_TYPE type_;
+    unsigned long val_;
 };
 
-
-
-class TestBase
-{
-    public:
-    TestBase()
-    {
-    }
-    virtual bool operator()(unsigned long input) const = 0;
-    virtual unsigned long val(void) const = 0;
-};
-
-class TestDivisibleBy: public TestBase
+class TestDivisibleBy
 {
     public:
-    TestDivisibleBy(unsigned long val)
+    TestDivisibleBy(unsigned long val = 1)
     : val_(val)
     {}
     
-    bool operator()(unsigned long input) const override
+    bool operator()(unsigned long input) const
     {
         return (input % val_) == 0;
     }
-    unsigned long val(void) const override {
+    unsigned long val(void) const {
         return val_;
     }
 
@@ -139,20 +141,20 @@ Monkey(std::ifstream &istream)
     {
         if (std::string(&line[pos + 2]) == "old")
         {
-        operation_ = std::make_unique<OperationSquared>();
+        operation_ = Operation(OPERATION_SQUARED);
         }
         else
         {
-        operation_ = std::make_unique<OperationMultiply>(atol(&line[pos+2]));
+        operation_ = Operation(OPERATION_MULTIPLY, atol(&line[pos+2]));
         }
     }
     else
     {
         auto pos = line.find("+");
-        operation_ = std::make_unique<OperationAdd>(atol(&line[pos+2]));
+        operation_ = Operation(OPERATION_ADD, atol(&line[pos+2]));
     }
     getline(istream, line);
-    test_ = std::make_unique<TestDivisibleBy>(atol(&line[21]));
+    test_ = TestDivisibleBy(atol(&line[21]));
     getline(istream, line);
     next_monkey_idx_[1] = atol(&line[29]);
     getline(istream, line);
@@ -164,39 +166,56 @@ void add_item(unsigned long val)
     items_.push_back(val);
 }
 
+const std::vector<unsigned long> &items(void) const
+{
+    return items_;
+}
+
+// Inspect one item on its own : updates worry, already reduced modulo
+// the product of all divisors, and returns the monkey it is thrown to
+size_t inspect(unsigned long &worry, const unsigned long modulo) const
+{
+    const auto new_worry = operation_(worry);
+    const size_t target = next_monkey_idx_[test_(new_worry)];
+    worry = new_worry % modulo;
+    return target;
+}
+
 unsigned long get_divisor(void) const
 {
-    return test_->val();
+    return test_.val();
 }
 
-struct ProcessOutput
+// Inspect every item this monkey holds in one go. Each step runs over
+// the whole batch at once : the operation, the reduction, then the test,
+// which partitions the batch in place into the items thrown to each target
+// so each run is appended with one insert. Order within a target doesn't
+// change any counts. modulo must be a multiple of every test divisor (it
+// is their product) so testing the reduced worry gives the same answer.
+// Items are swapped into batch_ first so a monkey throwing to itself is
+// still safe, and both vectors keep their capacity from round to round.
+void process_items(const unsigned long divide_by, const unsigned long modulo, std::vector<Monkey> &monkeys)
 {
-    unsigned long worry_;
-    size_t monkey_idx_;
-    ProcessOutput(const unsigned long worry, const size_t monkey_idx)
-    : worry_(worry)
-    , monkey_idx_(monkey_idx)
+    batch_.swap(items_);
+    process_counter_ += batch_.size();
+    operation_.apply(batch_);
+    if (divide_by != 1)
     {
+        for (auto &worry : batch_)
+        {
+            worry /= divide_by;
+        }
     }
-};
-std::optional<ProcessOutput> process_one_item(unsigned long divide_by)
-{
-    if (items_.empty())
+    for (auto &worry : batch_)
     {
-        return std::nullopt;
+        worry %= modulo;
     }
-    process_counter_ += 1;
-    const auto itemval = items_.front();
-    items_.pop_front();
-    const auto worry = (*operation_)(itemval) / divide_by;
-    #if 0
-    std::cout << "  Monkey inspects an item with a worry level of " << itemval << "." << std::endl;
-    std::cout << "    Worry level " << operation_->string() << " by " << operation_->val() << " to "  << (*operation_)(itemval) << "." << std::endl;
-    std::cout << "    Monkey gets bored with item. Worry level is divided by 3 to " << worry << "." << std::endl;
-    std::cout << "    Current worry level is not divisible by " << test_->val() << "." << std::endl;
-    std::cout << "    Item with worry level " << worry << " is thrown to monkey " << next_monkey_idx_[(*test_)(worry)] << std::endl;
-    #endif
-    return ProcessOutput(worry, next_monkey_idx_[(*test_)(worry)]);
+    const auto not_divisible = std::partition(batch_.begin(), batch_.end(), test_);
+    auto &if_true = monkeys[next_monkey_idx_[1]].items_;
+    auto &if_false = monkeys[next_monkey_idx_[0]].items_;
+    if_true.insert(if_true.end(), batch_.begin(), not_divisible);
+    if_false.insert(if_false.end(), not_divisible, batch_.end());
+    batch_.clear();
 }
 
 size_t get_process_counter(void) const
@@ -205,13 +224,197 @@ size_t get_process_counter(void) const
 }
 
 private:
-std::deque<unsigned long> items_;
-std::unique_ptr<OperationBase> operation_;
-std::unique_ptr<TestBase> test_;
+std::vector<unsigned long> items_;
+std::vector<unsigned long> batch_;
+Operation operation_;
+TestDivisibleBy test_;
 std::array<size_t, 2> next_monkey_idx_;
 size_t process_counter_{0};
 };
 
+// What an observer of run_rounds() sees. Everything is read straight from
+// the monkeys, so taking a snapshot allocates nothing.
+struct RoundSnapshot
+{
+    size_t round_;
+    std::span<const Monkey> monkeys_; // get_process_counter(), items().size()
+    double items_per_second_;         // inspections since the previous snapshot
+};
+
+// The round robin simulation. observer is called with a snapshot after
+// every interval rounds, or never if interval is 0.
+template <typename Observer>
+void run_rounds(std::vector<Monkey> &monkeys, const unsigned long modulo, const size_t rounds,
+                const size_t interval, Observer &&observer)
+{
+    size_t last_inspections = 0;
+    auto last_time = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++)
+    {
+        for (size_t monkey = 0; monkey < monkeys.size(); monkey++)
+        {
+            monkeys[monkey].process_items(1, modulo, monkeys);
+        }
+        if (interval && (((round + 1) % interval) == 0))
+        {
+            size_t inspections = 0;
+            for (const auto &m : monkeys)
+            {
+                inspections += m.get_process_counter();
+            }
+            const auto now = std::chrono::steady_clock::now();
+            const std::chrono::duration<double> elapsed = now - last_time;
+            observer(RoundSnapshot{round + 1, monkeys,
+                                   (inspections - last_inspections) / std::max(elapsed.count(), 1e-9)});
+            last_inspections = inspections;
+            last_time = now;
+        }
+    }
+}
+
+// Add one item's inspections over the given number of rounds to counts.
+// Items never affect each other, and worry is kept modulo the product of
+// the divisors, so where an item goes depends only on (holding monkey,
+// worry) at the start of each round. There are finitely many of those
+// states, so the item's rounds eventually repeat : once the state seen at
+// the start of one round comes round again, the inspections in between
+// repeat forever and the rest of the rounds are multiplied out rather
+// than simulated. Each round's inspections are a mask of monkeys - within
+// a round an item only moves on to higher numbered monkeys, so it visits
+// each at most once.
+void count_item_inspections(const std::vector<Monkey> &monkeys, const unsigned long modulo,
+                            size_t monkey, unsigned long worry, const size_t rounds,
+                            std::vector<size_t> &counts)
+{
+    std::unordered_map<unsigned long, size_t> first_seen; // state -> round
+    std::vector<uint64_t> round_masks;
+    auto add_rounds = [&](const size_t begin, const size_t end, const size_t times)
+    {
+        for (size_t r = begin; r < end; r++)
+        {
+            for (uint64_t mask = round_masks[r]; mask; mask &= mask - 1)
+            {
+                counts[__builtin_ctzll(mask)] += times;
+            }
+        }
+    };
+
+    worry %= modulo;
+    for (size_t round = 0; round < rounds; round++)
+    {
+        const auto [seen, inserted] = first_seen.try_emplace(monkey * modulo + worry, round);
+        if (!inserted)
+        {
+            const size_t cycle_start = seen->second;
+            const size_t cycle_length = round - cycle_start;
+            const size_t remaining = rounds - cycle_start;
+            add_rounds(0, cycle_start, 1);
+            add_rounds(cycle_start, round, remaining / cycle_length);
+            add_rounds(cycle_start, cycle_start + remaining % cycle_length, 1);
+            return;
+        }
+        uint64_t mask = 0;
+        for (;;)
+        {
+            mask |= 1ULL << monkey;
+            const size_t target = monkeys[monkey].inspect(worry, modulo);
+            const bool next_round = target <= monkey;
+            monkey = target;
+            if (next_round)
+            {
+                break;
+            }
+        }
+        round_masks.push_back(mask);
+    }
+    add_rounds(0, round_masks.size(), 1);
+}
+
+// Inspection counts per monkey, simulating each item separately
+std::vector<size_t> trajectory_counts(const std::vector<Monkey> &monkeys, const unsigned long modulo, const size_t rounds)
+{
+    std::vector<size_t> counts(monkeys.size());
+    for (size_t monkey = 0; monkey < monkeys.size(); monkey++)
+    {
+        for (const auto worry : monkeys[monkey].items())
+        {
+            count_item_inspections(monkeys, modulo, monkey, worry, rounds, counts);
+        }
+    }
+    return counts;
+}
+
+// As trajectory_counts(), with the items shared out between threads. Each
+// thread takes the next unclaimed item and counts into its own array, and
+// the arrays are summed once every thread is done.
+std::vector<size_t> parallel_trajectory_counts(const std::vector<Monkey> &monkeys, const unsigned long modulo,
+                                               const size_t rounds, const size_t thread_count)
+{
+    std::vector<std::pair<size_t, unsigned long>> items;
+    for (size_t monkey = 0; monkey < monkeys.size(); monkey++)
+    {
+        for (const auto worry : monkeys[monkey].items())
+        {
+            items.emplace_back(monkey, worry);
+        }
+    }
+
+    const size_t threads = std::max<size_t>(1, std::min(thread_count, items.size()));
+    std::vector<std::vector<size_t>> thread_counts(threads, std::vector<size_t>(monkeys.size()));
+    std::atomic<size_t> next_item{0};
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
+                             {
+            for (size_t i = next_item++; i < items.size(); i = next_item++)
+            {
+                count_item_inspections(monkeys, modulo, items[i].first, items[i].second, rounds, thread_counts[t]);
+            } });
+    }
+    for (auto &w : workers)
+    {
+        w.join();
+    }
+
+    std::vector<size_t> counts(monkeys.size());
+    for (const auto &tc : thread_counts)
+    {
+        std::transform(counts.cbegin(), counts.cend(), tc.cbegin(), counts.begin(), std::plus<size_t>());
+    }
+    return counts;
+}
+
+// Parse a whole argument as an unsigned count, false if it isn't one
+bool parse_count(const char *arg, size_t &count)
+{
+    const char *end = arg + strlen(arg);
+    const auto [ptr, ec] = std::from_chars(arg, end, count);
+    return (ec == std::errc()) && (ptr == end) && (ptr != arg);
+}
+
+__extension__ typedef unsigned __int128 uint128;
+std::string to_string(uint128 v)
+{
+    std::string ret;
+    do
+    {
+        ret += static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v);
+    std::reverse(ret.begin(), ret.end());
+    return ret;
+}
+
+// p1 input.txt [rounds N] [every N] [csv FILE] [trajectory] [parallel T]
+//   rounds N   : simulate N rounds rather than 10000
+//   every N    : report inspection counts every N rounds, 0 for never
+//   csv FILE   : write those reports to FILE as CSV instead, one row
+//                per monkey per report
+//   trajectory : follow each item separately, skipping repeated cycles,
+//                which makes huge round counts tractable
+//   parallel T : trajectory mode with the items split over T threads,
+//                0 for one per core
 int main(int argc, char **argv)
 {
     std::vector<Monkey> monkeys;
@@ -222,40 +425,121 @@ int main(int argc, char **argv)
         monkeys.emplace_back(istream);
     } while (getline(istream, str));
 
-    constexpr size_t rounds = 10000;
-    std::set<size_t> print_round = {1, 20, 1000, 2000, 3000, 4000, 5000, 6000, 7000, 8000, 9000};
-    unsigned long modulo = 1UL;
-    std::for_each(monkeys.cbegin(), monkeys.cend(), [&](const auto &m)
-                    { modulo *= m.get_divisor(); });
-    for (size_t round = 0; round < rounds; round++)
+    size_t rounds = 10000;
+    size_t interval = 1000;
+    const char *csv_path = nullptr;
+    bool reporting = false;
+    bool trajectory = false;
+    size_t threads = 1;
+    constexpr size_t max_threads = 1024;
+    for (int arg = 2; arg < argc; arg++)
     {
-        for (size_t monkey = 0; monkey < monkeys.size(); monkey++)
+        const std::string option(argv[arg]);
+        const bool takes_count = (option == "rounds") || (option == "every") || (option == "parallel");
+        size_t count = 0;
+        if (takes_count)
         {
-            //std::cout << "Monkey " << monkey << ":" << std::endl;
-            for (auto ret = monkeys[monkey].process_one_item(1); ret; ret = monkeys[monkey].process_one_item(1))
+            if (((arg + 1) >= argc) || !parse_count(argv[arg + 1], count))
             {
-                monkeys[ret->monkey_idx_].add_item(ret->worry_ % modulo);
+                std::cerr << option << " expects a non-negative number" << std::endl;
+                return 1;
             }
+            arg++;
         }
-        if (print_round.count(round + 1))
+        if (option == "rounds")
         {
-            std::cout << "Round " << round + 1 << std::endl;
-            std::vector<size_t> process_counts;
-            std::for_each(monkeys.cbegin(), monkeys.cend(), [&](const auto &m)
-                          { process_counts.push_back(m.get_process_counter()); });
-
-            std::copy(process_counts.cbegin(), process_counts.cend(), std::ostream_iterator<size_t>(std::cout, " "));
-            std::cout << std::endl;
+            rounds = count;
+        }
+        else if (option == "every")
+        {
+            interval = count;
+            reporting = true;
+        }
+        else if ((option == "csv") && ((arg + 1) < argc))
+        {
+            csv_path = argv[++arg];
+            reporting = true;
+        }
+        else if (option == "trajectory")
+        {
+            trajectory = true;
+        }
+        else if (option == "parallel")
+        {
+            if (count > max_threads)
+            {
+                std::cerr << "Thread count " << count << " : expected 0 to " << max_threads << std::endl;
+                return 1;
+            }
+            trajectory = true;
+            threads = count ? count : std::max(1U, std::thread::hardware_concurrency());
+        }
+        else
+        {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
         }
     }
-
+    if (trajectory && reporting)
+    {
+        std::cerr << "every and csv report on the round loop, so can't be used with trajectory or parallel" << std::endl;
+        return 1;
+    }
+    if (trajectory && (monkeys.size() > 64))
+    {
+        std::cerr << "trajectory mode handles at most 64 monkeys" << std::endl;
+        return 1;
+    }
+    std::ofstream csv;
+    if (csv_path)
+    {
+        csv.open(csv_path);
+        if (!csv)
+        {
+            std::cerr << "Can't write " << csv_path << std::endl;
+            return 1;
+        }
+        csv << "round,monkey,inspections,queue_depth,items_per_second" << std::endl;
+    }
+    unsigned long modulo = 1UL;
+    std::for_each(monkeys.cbegin(), monkeys.cend(), [&](const auto &m)
+                    { modulo *= m.get_divisor(); });
     std::vector<size_t> process_counts;
-    std::for_each(monkeys.cbegin(), monkeys.cend(), [&](const auto &v)
-                  { process_counts.push_back(v.get_process_counter()); });
+    if (trajectory)
+    {
+        process_counts = (threads > 1) ? parallel_trajectory_counts(monkeys, modulo, rounds, threads)
+                                       : trajectory_counts(monkeys, modulo, rounds);
+    }
+    else
+    {
+        run_rounds(monkeys, modulo, rounds, interval, [&](const RoundSnapshot &snapshot)
+                   {
+            if (csv.is_open())
+            {
+                for (size_t m = 0; m < snapshot.monkeys_.size(); m++)
+                {
+                    csv << snapshot.round_ << ',' << m << ',' << snapshot.monkeys_[m].get_process_counter() << ','
+                        << snapshot.monkeys_[m].items().size() << ',' << snapshot.items_per_second_ << '\n';
+                }
+                return;
+            }
+            std::cout << "Round " << snapshot.round_ << std::endl;
+            for (const auto &m : snapshot.monkeys_)
+            {
+                std::cout << m.get_process_counter() << " ";
+            }
+            std::cout << std::endl; });
+    }
+
+    if (!trajectory)
+    {
+        std::for_each(monkeys.cbegin(), monkeys.cend(), [&](const auto &v)
+                      { process_counts.push_back(v.get_process_counter()); });
+    }
     std::sort(process_counts.begin(), process_counts.end());
     std::copy(process_counts.cbegin(), process_counts.cend(), std::ostream_iterator<size_t>(std::cout, " "));
     std::cout << std::endl;
-    std::cout << process_counts.back() * process_counts[process_counts.size()- 2] << std::endl;
+    std::cout << to_string(static_cast<uint128>(process_counts.back()) * process_counts[process_counts.size()- 2]) << std::endl;
 
     return 0;
 }
\ No newline at end of file
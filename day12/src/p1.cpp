@@ -1,10 +1,13 @@
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstring>
 #include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
 #include <optional>
@@ -12,6 +15,75 @@
 #include <set>
 #include <vector>
 
+// Search tracing is compiled out entirely unless built with
+// -DTRACE_SEARCH=1, in which case trace records are buffered and
+// written to a binary log file rather than printed
+#ifndef TRACE_SEARCH
+#define TRACE_SEARCH 0
+#endif
+constexpr bool trace_search = TRACE_SEARCH;
+
+enum TRACE_EVENT : uint32_t
+{
+    TRACE_CHECK_MOVE, // a = from cell, b = to cell
+    TRACE_VALID_MOVE, // a = from cell, b = to cell
+    TRACE_DEQUEUE     // a = cell, b = distance
+};
+
+class TraceLog
+{
+public:
+    struct Record
+    {
+        uint32_t event_;
+        uint32_t a_;
+        uint32_t b_;
+    };
+    ~TraceLog()
+    {
+        flush();
+    }
+    void open(const char *filename)
+    {
+        ostream_.open(filename, std::ofstream::out | std::ofstream::binary);
+        buffer_.reserve(buffer_records);
+    }
+    void record(const TRACE_EVENT event, const uint32_t a, const uint32_t b)
+    {
+        if (!ostream_.is_open())
+        {
+            return;
+        }
+        buffer_.push_back(Record{event, a, b});
+        if (buffer_.size() == buffer_records)
+        {
+            flush();
+        }
+    }
+    void flush(void)
+    {
+        if (buffer_.size())
+        {
+            ostream_.write(reinterpret_cast<const char *>(buffer_.data()), buffer_.size() * sizeof(Record));
+            buffer_.clear();
+        }
+    }
+
+private:
+    static constexpr size_t buffer_records = 4096;
+    std::ofstream ostream_;
+    std::vector<Record> buffer_;
+};
+TraceLog trace_log;
+
+inline void trace(const TRACE_EVENT event, const uint32_t a, const uint32_t b)
+{
+    if constexpr (trace_search)
+    {
+        trace_log.record(event, a, b);
+    }
+}
+
 struct Direction
 {
     int dx_;
@@ -24,11 +96,11 @@ struct Direction
 };
 struct Coord
 {
-    uint8_t x_{};
-    uint8_t y_{};
+    uint32_t x_{};
+    uint32_t y_{};
     Coord() = default;
     Coord(const Coord&) = default;
-    Coord(uint8_t x, uint8_t y)
+    Coord(uint32_t x, uint32_t y)
     : x_ (x)
     , y_ (y)
     {}
@@ -49,102 +121,147 @@ struct Coord
 };
 std::ostream& operator<<(std::ostream &os, const Coord &c)
 {
-    os << "(" << static_cast<int>(c.x_) << ", " << static_cast<int>(c.y_) << ")";
+    os << "(" << c.x_ << ", " << c.y_ << ")";
     return os;
 }
 
+// Cells are addressed by a 32-bit linear index into the padded grid
+using CellIndex = uint32_t;
+using Distance = uint32_t;
+constexpr Distance unreached = std::numeric_limits<Distance>::max();
+
 class Map
 {
 public:
-    using MapRow = std::vector<uint8_t>;
+    static constexpr uint8_t border_height = std::numeric_limits<uint8_t>::max();
+
     Map(const char *filename)
     {
-        map_.push_back(MapRow());
         std::ifstream istream(filename, std::ifstream::in);
+        std::vector<std::string> lines;
         std::string line;
         while (getline(istream, line))
         {
-            std::cout << "line = " << line << std::endl;
-            map_.push_back(MapRow());
-            auto &r = map_.back();
-            r.push_back(std::numeric_limits<uint8_t>::max());
-            for (const auto c : line)
+            lines.push_back(line);
+        }
+
+        // Surround the map with a one cell border which can't be stepped on,
+        // so moves never need to be bounds checked
+        width_ = lines.size() ? (lines[0].size() + 2) : 2;
+        rows_ = lines.size() + 2;
+        heights_.assign(width_ * rows_, border_height);
+        for (uint32_t y = 0; y < lines.size(); y++)
+        {
+            for (uint32_t x = 0; x < lines[y].size(); x++)
             {
+                const Coord coord(x + 1, y + 1);
+                const char c = lines[y][x];
+                uint8_t height = 0;
                 if (islower(c))
                 {
-                    r.push_back(c - 'a');
+                    height = c - 'a';
                 }
                 else if (c == 'S')
                 {
-                    r.push_back(0);
-                    
+                    start_coord_ = coord;
                 }
                 else if (c == 'E')
                 {
-                    end_coord_.x_ = r.size();
-                    end_coord_.y_ = map_.size() - 1;
-                    r.push_back('z' - 'a');
+                    end_coord_ = coord;
+                    height = 'z' - 'a';
                 }
-                if (r.back() == 0)
+                heights_[index(coord)] = height;
+                if (height == 0)
                 {
-                    Coord start_coord (r.size() - 1, map_.size() - 1);
-                    start_coords_.push_back(start_coord);
+                    start_coords_.push_back(coord);
                 }
             }
-            r.push_back(std::numeric_limits<uint8_t>::max());
         }
-        map_.push_back(MapRow(map_.back().size(), std::numeric_limits<uint8_t>::max()));
-        map_[0] = map_.back();
-        reset_min_path();
 
+        const std::array<Direction, direction_count> directions = {
+            Direction{-1, 0},
+            Direction{1, 0},
+            Direction{0, -1},
+            Direction{0, 1}
+        };
+        for (size_t d = 0; d < direction_count; d++)
+        {
+            offsets_[d] = directions[d].dy_ * static_cast<int32_t>(width_) + directions[d].dx_;
+        }
+        step_masks_.resize(heights_.size());
+        for (CellIndex idx = 0; idx < heights_.size(); idx++)
+        {
+            update_step_mask(idx);
+        }
     }
-    void reset_min_path(void)
+
+    // Calls f(to) for each cell which can be stepped to from origin. With
+    // reverse set, calls it for the neighbors which can step to origin
+    // instead. Used to search backwards from the end.
+    template <typename F>
+    void valid_moves(const CellIndex origin, const bool reverse, F &&f) const
     {
-        min_path_length_to_coord_.clear();
-        for (const auto &sc: start_coords_)
+        uint8_t mask = reverse ? (step_masks_[origin] >> direction_count) : (step_masks_[origin] & direction_mask);
+        for (; mask; mask &= mask - 1)
         {
-            min_path_length_to_coord_[sc] = 0;
+            const CellIndex to = origin + offsets_[__builtin_ctz(mask)];
+            trace(TRACE_VALID_MOVE, origin, to);
+            f(to);
         }
     }
-    std::vector<Coord> valid_moves(const Coord &origin, const size_t path_len) const
+
+    // True for cells inside the border, the only ones which can be edited
+    bool interior(const Coord &coord) const
     {
-        const std::array<Direction, 4> directions = {
-            Direction{-1, 0},
-            Direction{1, 0},
-            Direction{0, -1},
-            Direction{0, 1}
-        };
-        std::vector<Coord> ret;
-        std::for_each(directions.cbegin(), directions.cend(), [&](const auto &d) {
-            const Coord map_coord = origin + d;
-            std::cout << "From " << origin << " = " << static_cast<int>(map_[origin.y_][origin.x_]) <<
-            " to " << map_coord << " = " << static_cast<int>(map_[map_coord.y_][map_coord.x_]) << std::endl;
+        return (coord.x_ >= 1) && (coord.x_ + 1 < width_) &&
+               (coord.y_ >= 1) && (coord.y_ + 1 < rows_);
+    }
 
-            if (map_[map_coord.y_][map_coord.x_] <= (map_[origin.y_][origin.x_] + 1))
+    // Change the height of one non-border cell. Only the step masks
+    // of that cell and its four neighbors depend on it. Refuses, returning
+    // false, border cells and heights above 'z'.
+    bool set_height(const Coord &coord, const uint8_t height)
+    {
+        if (!interior(coord) || (height > ('z' - 'a')))
+        {
+            return false;
+        }
+        const CellIndex idx = index(coord);
+        const uint8_t old_height = heights_[idx];
+        heights_[idx] = height;
+        update_step_mask(idx);
+        for (const auto offset : offsets_)
+        {
+            update_step_mask(idx + offset);
+        }
+        if ((old_height == 0) && (height != 0))
+        {
+            start_coords_.erase(std::find(start_coords_.begin(), start_coords_.end(), coord));
+        }
+        else if ((old_height != 0) && (height == 0))
+        {
+            start_coords_.push_back(coord);
+        }
+        return true;
+    }
+
+    // Calls f(neighbor) for each non-border cell next to origin
+    template <typename F>
+    void neighbors(const CellIndex origin, F &&f) const
+    {
+        for (const auto offset : offsets_)
+        {
+            if (heights_[origin + offset] != border_height)
             {
-                auto it = min_path_length_to_coord_.find(map_coord);
-                if (it != min_path_length_to_coord_.end())
-                {
-                    size_t prev_best = it->second;
-                    std::cout << map_coord << " seen before, previous best len = " << prev_best << " this len = " << path_len << std::endl;
-                    if (prev_best <= path_len)
-                    {
-                        return;
-                    }
-                    it->second = path_len + 1;
-                }
-                else
-                {
-                    std::cout << "Adding " << map_coord << " with length " << path_len << std::endl;
-                    min_path_length_to_coord_[map_coord] = path_len;
-                }
-                std::cout << "From " << origin << " to " << map_coord << " is a valid move" << std::endl;
-                ret.push_back(map_coord);
+                f(origin + offset);
             }
-        });
-        return ret;
+        }
     }
 
+    const Coord& start_coord() const
+    {
+        return start_coord_;
+    }
     const std::vector<Coord>& start_coords() const
     {
         return start_coords_;
@@ -153,22 +270,78 @@ public:
     {
         return end_coord_;
     }
+
+    size_t size() const
+    {
+        return heights_.size();
+    }
+    CellIndex index(const Coord &c) const
+    {
+        return c.y_ * width_ + c.x_;
+    }
+    Coord coord(const CellIndex idx) const
+    {
+        return Coord(idx % width_, idx / width_);
+    }
+    uint8_t height(const CellIndex idx) const
+    {
+        return heights_[idx];
+    }
     friend std::ostream& operator<<(std::ostream &os, const Map &m);
+
 private:
-    std::vector<MapRow> map_;
+    static constexpr size_t direction_count = 4;
+    static constexpr uint8_t direction_mask = (1U << direction_count) - 1;
+
+    // Each cell keeps a bit per direction for the moves out of it in the
+    // low nibble and for the moves into it in the high nibble, so searches
+    // never have to compare heights
+    bool can_step(const CellIndex from, const CellIndex to) const
+    {
+        return (heights_[from] != border_height) &&
+               (heights_[to] != border_height) &&
+               (heights_[to] <= (heights_[from] + 1));
+    }
+    void update_step_mask(const CellIndex idx)
+    {
+        uint8_t mask = 0;
+        if (heights_[idx] != border_height)
+        {
+            for (size_t d = 0; d < direction_count; d++)
+            {
+                const CellIndex neighbor = idx + offsets_[d];
+                trace(TRACE_CHECK_MOVE, idx, neighbor);
+                if (can_step(idx, neighbor))
+                {
+                    mask |= 1U << d;
+                }
+                if (can_step(neighbor, idx))
+                {
+                    mask |= 1U << (d + direction_count);
+                }
+            }
+        }
+        step_masks_[idx] = mask;
+    }
+
+    uint32_t width_{};
+    uint32_t rows_{};
+    std::vector<uint8_t> heights_;
+    std::vector<uint8_t> step_masks_;
+    std::array<int32_t, direction_count> offsets_{};
+    Coord start_coord_;
     std::vector<Coord> start_coords_;
     Coord end_coord_;
-    mutable std::map<Coord, size_t> min_path_length_to_coord_;
 };
 std::ostream& operator<<(std::ostream &os, const Map &m)
 {
-    for (const auto &r : m.map_)
+    for (uint32_t y = 0; y < m.rows_; y++)
     {
-        for (const auto c : r)
+        for (uint32_t x = 0; x < m.width_; x++)
         {
-            os << static_cast<int>(c) << " ";
+            os << static_cast<int>(m.heights_[m.index(Coord(x, y))]) << " ";
         }
-        os << std::endl;
+        os << '\n';
     }
     os << "Start coords : ";
     for (const auto &sc : m.start_coords_)
@@ -180,105 +353,586 @@ std::ostream& operator<<(std::ostream &os, const Map &m)
     return os;
 }
 
-class Path
+// Breadth-first search over the map. Every edge costs one step, so the
+// first time a cell is dequeued its distance is final - each cell is
+// visited at most once, giving O(cells) time and memory per search.
+class BfsSearch
 {
 public:
-    Path(const Coord &start){
-        path_coords_.push_back(start);
+    BfsSearch(const Map &map, const bool record_predecessors = false)
+        : map_(map)
+        , distance_(map.size(), unreached)
+        , queue_(map.size())
+    {
+        if (record_predecessors)
+        {
+            predecessor_.resize(map.size());
+        }
     }
-    Path(const Path &prev_moves, const Coord &new_move) 
-    : path_coords_(prev_moves.path_coords_)
+
+    // Returns the number of steps from start to end, or nullopt if
+    // end can't be reached
+    std::optional<size_t> run(const Coord &start, const Coord &end)
     {
-        path_coords_.push_back(new_move);
+        return search(start, map_.index(end), false);
     }
-    bool operator<(const Path &other) const {
-        return path_coords_.size() >  other.path_coords_.size();
+
+    // Search backwards from end with the climb rule inverted until every
+    // reachable cell is visited. Afterwards distance(c) is the length of the
+    // shortest path from c to end, so any number of start cells can be
+    // looked up from a single traversal.
+    void run_reverse(const Coord &end)
+    {
+        search(end, map_.size(), true);
     }
-    const Coord& back() const{
-        return path_coords_.back();
+
+    Distance distance(const Coord &coord) const
+    {
+        return distance_[map_.index(coord)];
     }
-    size_t length() const{
-        return path_coords_.size();
+
+    // Number of cells taken off the queue by the last search
+    size_t expanded() const
+    {
+        return expanded_;
     }
-    void append(const Coord &coord) {
-        path_coords_.push_back(coord);
+
+    // Walk the predecessor links back from end to recover the path
+    // found by the last run(). Requires record_predecessors. After
+    // run_reverse() the path starts at the map's end coord instead.
+    std::vector<Coord> path_to(const Coord &end) const
+    {
+        std::vector<Coord> ret;
+        CellIndex idx = map_.index(end);
+        if (predecessor_.empty() || (distance_[idx] == unreached))
+        {
+            return ret;
+        }
+        const Distance steps = distance_[idx];
+        for (Distance i = 0; i < steps; i++)
+        {
+            ret.push_back(map_.coord(idx));
+            idx = predecessor_[idx];
+        }
+        ret.push_back(map_.coord(idx));
+        std::reverse(ret.begin(), ret.end());
+        return ret;
     }
-    void set_valid(const size_t len)
+
+private:
+    std::optional<size_t> search(const Coord &start, const size_t stop_idx, const bool reverse)
     {
-        if (len <= path_coords_.size())
+        std::fill(distance_.begin(), distance_.end(), unreached);
+        head_ = 0;
+        tail_ = 0;
+        expanded_ = 0;
+
+        push(map_.index(start), 0);
+        while (head_ != tail_)
         {
-            std::cout << "Set valid (1arg) : clearing path " << path_coords_.back() << " with len " << path_coords_.size() << std::endl;
-            valid_ = false;
+            const CellIndex idx = pop();
+            trace(TRACE_DEQUEUE, idx, distance_[idx]);
+            expanded_ += 1;
+            if (idx == stop_idx)
+            {
+                return distance_[idx];
+            }
+            map_.valid_moves(idx, reverse, [&](const CellIndex next_idx) {
+                if (distance_[next_idx] == unreached)
+                {
+                    push(next_idx, distance_[idx] + 1);
+                    if (predecessor_.size())
+                    {
+                        predecessor_[next_idx] = idx;
+                    }
+                }
+            });
         }
+        return std::nullopt;
+    }
+
+    // The queue is a ring buffer sized to hold every cell. Each cell
+    // is only pushed the first time it is reached so it can never overflow.
+    void push(const CellIndex idx, const Distance distance)
+    {
+        distance_[idx] = distance;
+        queue_[tail_] = idx;
+        tail_ = (tail_ + 1 == queue_.size()) ? 0 : tail_ + 1;
+    }
+    CellIndex pop()
+    {
+        const CellIndex idx = queue_[head_];
+        head_ = (head_ + 1 == queue_.size()) ? 0 : head_ + 1;
+        return idx;
     }
-    void set_valid(const Coord &coord, const size_t len)
+
+    const Map &map_;
+    std::vector<Distance> distance_;
+    std::vector<CellIndex> predecessor_;
+    std::vector<CellIndex> queue_;
+    size_t head_{0};
+    size_t tail_{0};
+    size_t expanded_{0};
+};
+
+// Lower bounds on the number of steps left from a cell to the end. Both
+// are consistent - a single step can't reduce either by more than one -
+// so A* never has to reopen a cell.
+enum HEURISTIC
+{
+    MANHATTAN,         // grid distance to the end
+    HEIGHT_DIFFERENCE, // each step climbs at most one level
+    MAX_HEURISTIC      // the larger of the two
+};
+
+// A* search from a single start to a single end. Every step costs one, so
+// f = g + h is a small integer and the open set is a bucket queue indexed
+// by f rather than a heap. f never decreases along a search with a
+// consistent heuristic, so buckets below the current one are never revisited.
+class AStarSearch
+{
+public:
+    AStarSearch(const Map &map, const HEURISTIC heuristic)
+        : map_(map)
+        , heuristic_(heuristic)
+        , distance_(map.size(), unreached)
+        , closed_(map.size(), false)
     {
-        if (coord == path_coords_.back())
+    }
+
+    std::optional<size_t> run(const Coord &start, const Coord &end)
+    {
+        std::fill(distance_.begin(), distance_.end(), unreached);
+        std::fill(closed_.begin(), closed_.end(), false);
+        for (auto &b : buckets_)
         {
-            if (len <= path_coords_.size())
+            b.clear();
+        }
+        expanded_ = 0;
+        end_ = end;
+        end_height_ = map_.height(map_.index(end));
+
+        const CellIndex end_idx = map_.index(end);
+        const CellIndex start_idx = map_.index(start);
+        distance_[start_idx] = 0;
+        push(start_idx);
+        for (size_t f = 0; f < buckets_.size(); f++)
+        {
+            // Expanding a cell only pushes into this bucket or later ones,
+            // so buckets_ may grow but this bucket's index stays valid
+            while (buckets_[f].size())
             {
-                std::cout << "Set valid (2arg) : clearing path " << path_coords_.back() << " with len " << path_coords_.size() << std::endl;
-                valid_ = false;
+                const CellIndex idx = buckets_[f].back();
+                buckets_[f].pop_back();
+                if (closed_[idx])
+                {
+                    continue;
+                }
+                closed_[idx] = true;
+                trace(TRACE_DEQUEUE, idx, distance_[idx]);
+                expanded_ += 1;
+                if (idx == end_idx)
+                {
+                    return distance_[idx];
+                }
+                map_.valid_moves(idx, false, [&](const CellIndex next_idx) {
+                    if (!closed_[next_idx] && (distance_[idx] + 1 < distance_[next_idx]))
+                    {
+                        distance_[next_idx] = distance_[idx] + 1;
+                        push(next_idx);
+                    }
+                });
             }
         }
+        return std::nullopt;
     }
-    bool valid() const
+
+    size_t expanded() const
     {
-        return valid_;
+        return expanded_;
     }
+
 private:
-    std::vector<Coord> path_coords_;
-    bool valid_{true};
+    Distance estimate(const CellIndex idx) const
+    {
+        const Coord c = map_.coord(idx);
+        const Distance manhattan = ((c.x_ > end_.x_) ? (c.x_ - end_.x_) : (end_.x_ - c.x_)) +
+                                   ((c.y_ > end_.y_) ? (c.y_ - end_.y_) : (end_.y_ - c.y_));
+        const uint8_t height = map_.height(idx);
+        const Distance climb = (end_height_ > height) ? (end_height_ - height) : 0;
+        switch (heuristic_)
+        {
+        case MANHATTAN:
+            return manhattan;
+        case HEIGHT_DIFFERENCE:
+            return climb;
+        case MAX_HEURISTIC:
+            return std::max(manhattan, climb);
+        }
+        return 0;
+    }
+    void push(const CellIndex idx)
+    {
+        const size_t f = distance_[idx] + estimate(idx);
+        if (f >= buckets_.size())
+        {
+            buckets_.resize(f + 1);
+        }
+        buckets_[f].push_back(idx);
+    }
+
+    const Map &map_;
+    HEURISTIC heuristic_;
+    std::vector<Distance> distance_;
+    std::vector<bool> closed_;
+    std::vector<std::vector<CellIndex>> buckets_;
+    Coord end_;
+    uint8_t end_height_{};
+    size_t expanded_{0};
 };
 
-int main(int argc, char **argv)
+// Breadth-first search run from both ends at once - forwards from the start
+// and backwards from the end - always advancing the side with the smaller
+// frontier by one whole level. The first level in which the two searches
+// touch contains a shortest path, so each side only has to cover roughly
+// half the path length.
+class BidirectionalSearch
 {
-    Map map(argv[1]);
-    std::cout << "Map " << std::endl << map;
-    size_t best_path_length = std::numeric_limits<size_t>::max();
+public:
+    BidirectionalSearch(const Map &map)
+        : map_(map)
+        , distance_{std::vector<Distance>(map.size(), unreached), std::vector<Distance>(map.size(), unreached)}
+    {
+    }
 
-    const auto &start_coords = map.start_coords();
-    for (const auto &sc : start_coords)
+    std::optional<size_t> run(const Coord &start, const Coord &end)
     {
-        std::deque<Path> paths;
-        paths.push_back(Path(sc));
+        for (size_t side = 0; side < 2; side++)
+        {
+            std::fill(distance_[side].begin(), distance_[side].end(), unreached);
+            frontier_[side].clear();
+        }
+        expanded_ = 0;
+
+        const CellIndex start_idx = map_.index(start);
+        const CellIndex end_idx = map_.index(end);
+        if (start_idx == end_idx)
+        {
+            return 0;
+        }
+        distance_[0][start_idx] = 0;
+        frontier_[0].push_back(start_idx);
+        distance_[1][end_idx] = 0;
+        frontier_[1].push_back(end_idx);
 
-        while (paths.size())
+        while (frontier_[0].size() && frontier_[1].size())
         {
-            const auto path = paths.front();
-            paths.pop_front();
-            if (!path.valid())
+            const size_t side = (frontier_[0].size() <= frontier_[1].size()) ? 0 : 1;
+            const auto &this_distance = distance_[side];
+            const auto &other_distance = distance_[1 - side];
+            Distance best = unreached;
+            next_frontier_.clear();
+            for (const auto idx : frontier_[side])
+            {
+                trace(TRACE_DEQUEUE, idx, this_distance[idx]);
+                expanded_ += 1;
+                map_.valid_moves(idx, side == 1, [&](const CellIndex next_idx) {
+                    if (other_distance[next_idx] != unreached)
+                    {
+                        best = std::min(best, this_distance[idx] + 1 + other_distance[next_idx]);
+                    }
+                    else if (distance_[side][next_idx] == unreached)
+                    {
+                        distance_[side][next_idx] = this_distance[idx] + 1;
+                        next_frontier_.push_back(next_idx);
+                    }
+                });
+            }
+            if (best != unreached)
+            {
+                return best;
+            }
+            std::swap(frontier_[side], next_frontier_);
+        }
+        return std::nullopt;
+    }
+
+    size_t expanded() const
+    {
+        return expanded_;
+    }
+
+private:
+    const Map &map_;
+    // Index 0 is the forward search, 1 the backward one
+    std::array<std::vector<Distance>, 2> distance_;
+    std::array<std::vector<CellIndex>, 2> frontier_;
+    std::vector<CellIndex> next_frontier_;
+    size_t expanded_{0};
+};
+
+// Distance from every cell to the end, kept up to date as cell heights
+// change. A height edit only changes the edges into and out of that cell,
+// so rather than rerunning the reverse BFS, repair() works outwards from the
+// edited cell in two phases, in the style of dynamic SSSP / LPA*:
+//  - cells whose shortest path relied on an edge that no longer exists
+//    lose their distance, along with anything whose path ran through them
+//  - those cells, plus any which gained an edge, get new distances from
+//    their still-valid neighbors, which are then pushed outwards in
+//    distance order, Dijkstra style
+// Only the region whose distances actually change is visited.
+class DynamicDistanceField
+{
+public:
+    DynamicDistanceField(Map &map)
+        : map_(map)
+        , distance_(map.size(), unreached)
+    {
+        rebuild();
+    }
+
+    // Recompute every distance from scratch with a reverse BFS
+    void rebuild(void)
+    {
+        BfsSearch search(map_);
+        search.run_reverse(map_.end_coord());
+        for (CellIndex idx = 0; idx < distance_.size(); idx++)
+        {
+            distance_[idx] = search.distance(map_.coord(idx));
+        }
+    }
+
+    bool set_height(const Coord &coord, const uint8_t height)
+    {
+        if (!map_.set_height(coord, height))
+        {
+            return false;
+        }
+        repair(map_.index(coord));
+        return true;
+    }
+
+    Distance distance(const Coord &coord) const
+    {
+        return distance_[map_.index(coord)];
+    }
+
+    // Number of cells whose distance was rechecked by the last repair
+    size_t touched() const
+    {
+        return touched_;
+    }
+
+private:
+    void repair(const CellIndex changed_idx)
+    {
+        const CellIndex end_idx = map_.index(map_.end_coord());
+        touched_ = 0;
+
+        // Cells whose outgoing edges may have changed - the edited one and
+        // all of its neighbors, since edges to them may have been removed
+        check_.clear();
+        check_.push_back(changed_idx);
+        map_.neighbors(changed_idx, [&](const CellIndex idx) { check_.push_back(idx); });
+        reseed_ = check_;
+
+        // Phase 1 : drop the distance of any cell which no longer has a
+        // neighbor one step closer to the end
+        invalidated_.clear();
+        while (check_.size())
+        {
+            const CellIndex idx = check_.back();
+            check_.pop_back();
+            touched_ += 1;
+            const Distance old_distance = distance_[idx];
+            if ((idx == end_idx) || (old_distance == unreached))
             {
                 continue;
             }
-            std::cout << "Next move from " << path.back() << std::endl;
-            const auto next_moves = map.valid_moves(path.back(), path.length());
-            for (const auto &m : next_moves)
+            bool supported = false;
+            map_.valid_moves(idx, false, [&](const CellIndex next_idx) {
+                supported |= (distance_[next_idx] != unreached) && (distance_[next_idx] + 1 == old_distance);
+            });
+            if (supported)
             {
-                std::cout << "    Next move = " << m << std::endl;
-                if (m == map.end_coord())
+                continue;
+            }
+            distance_[idx] = unreached;
+            invalidated_.push_back(idx);
+            map_.valid_moves(idx, true, [&](const CellIndex prev_idx) {
+                if (distance_[prev_idx] == old_distance + 1)
                 {
-                    best_path_length = std::min(best_path_length, path.length());
-                    for (auto &p : paths)
-                    {
-                        p.set_valid(best_path_length);
-                    }
-                    std::cout << "New path found, length = " << path.length() << std::endl;
+                    check_.push_back(prev_idx);
                 }
-                else
+            });
+        }
+
+        // Phase 2 : give the affected cells the best distance available from
+        // their neighbors, then propagate any improvement backwards
+        open_ = OpenSet();
+        const auto seed = [&](const CellIndex idx) {
+            if (idx == end_idx)
+            {
+                return;
+            }
+            Distance best = unreached;
+            map_.valid_moves(idx, false, [&](const CellIndex next_idx) {
+                if (distance_[next_idx] != unreached)
                 {
-                    if (path.length() <= best_path_length)
-                    {
-                        for (auto &p : paths)
-                        {
-                            p.set_valid(m, path.length());
-                        }
-                        paths.push_back(Path(path, m));
-                    }
+                    best = std::min(best, distance_[next_idx] + 1);
                 }
+            });
+            if (best < distance_[idx])
+            {
+                distance_[idx] = best;
+                open_.push({best, idx});
             }
+        };
+        std::for_each(invalidated_.cbegin(), invalidated_.cend(), seed);
+        std::for_each(reseed_.cbegin(), reseed_.cend(), seed);
+        while (open_.size())
+        {
+            const auto [d, idx] = open_.top();
+            open_.pop();
+            touched_ += 1;
+            if (d != distance_[idx])
+            {
+                continue;
+            }
+            map_.valid_moves(idx, true, [&](const CellIndex prev_idx) {
+                if (d + 1 < distance_[prev_idx])
+                {
+                    distance_[prev_idx] = d + 1;
+                    open_.push({d + 1, prev_idx});
+                }
+            });
         }
     }
 
+    using OpenSet = std::priority_queue<std::pair<Distance, CellIndex>,
+                                        std::vector<std::pair<Distance, CellIndex>>,
+                                        std::greater<std::pair<Distance, CellIndex>>>;
+    Map &map_;
+    std::vector<Distance> distance_;
+    std::vector<CellIndex> check_;
+    std::vector<CellIndex> reseed_;
+    std::vector<CellIndex> invalidated_;
+    OpenSet open_;
+    size_t touched_{0};
+};
+
+template <typename Search>
+void report_search(const char *name, Search &search, const Map &map)
+{
+    const auto path_length = search.run(map.start_coord(), map.end_coord());
+    std::cout << name << " : path length from S = ";
+    if (path_length)
+    {
+        std::cout << *path_length;
+    }
+    else
+    {
+        std::cout << "unreachable";
+    }
+    std::cout << ", nodes expanded = " << search.expanded() << std::endl;
+}
+int main(int argc, char **argv)
+{
+    if constexpr (trace_search)
+    {
+        trace_log.open("search_trace.bin");
+    }
+    Map map(argv[1]);
+    // The full padded grid is only worth printing when debugging, it would
+    // dominate the run time on a large map
+    if constexpr (trace_search)
+    {
+        std::cout << "Map " << std::endl << map;
+    }
+
+    // "edit x y c ..." changes the height of each cell (x, y) to that of
+    // letter c in turn, re-planning incrementally after each change
+    if ((argc > 2) && (std::string(argv[2]) == "edit"))
+    {
+        DynamicDistanceField field(map);
+        for (int arg = 3; (arg + 2) < argc; arg += 3)
+        {
+            const int x = atoi(argv[arg]);
+            const int y = atoi(argv[arg + 1]);
+            const char letter = argv[arg + 2][0];
+            if ((x < 0) || (y < 0) || !map.interior(Coord(x, y)) ||
+                (letter < 'a') || (letter > 'z') || argv[arg + 2][1])
+            {
+                std::cerr << "Can't set " << argv[arg] << " " << argv[arg + 1] << " to " << argv[arg + 2]
+                          << " : expected a cell inside the border and a letter a-z" << std::endl;
+                return 1;
+            }
+            const Coord coord(x, y);
+            const uint8_t height = letter - 'a';
+            const auto start_time = std::chrono::steady_clock::now();
+            field.set_height(coord, height);
+            Distance best_path_length = unreached;
+            for (const auto &sc : map.start_coords())
+            {
+                best_path_length = std::min(best_path_length, field.distance(sc));
+            }
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time);
+            std::cout << "Set " << coord << " to " << argv[arg + 2][0] << " : path length from S = " << field.distance(map.start_coord())
+                      << ", best path length = " << best_path_length << ", cells touched = " << field.touched()
+                      << ", " << elapsed.count() << " us" << std::endl;
+        }
+        return 0;
+    }
+
+    // An optional engine name searches just from S to the end with that
+    // engine, to compare how much of the map each one has to expand
+    if (argc > 2)
+    {
+        const std::string engine(argv[2]);
+        if (engine == "bfs")
+        {
+            BfsSearch search(map);
+            report_search("bfs", search, map);
+        }
+        else if (engine == "astar-manhattan")
+        {
+            AStarSearch search(map, MANHATTAN);
+            report_search("astar-manhattan", search, map);
+        }
+        else if (engine == "astar-height")
+        {
+            AStarSearch search(map, HEIGHT_DIFFERENCE);
+            report_search("astar-height", search, map);
+        }
+        else if (engine == "astar")
+        {
+            AStarSearch search(map, MAX_HEURISTIC);
+            report_search("astar", search, map);
+        }
+        else if (engine == "bidir")
+        {
+            BidirectionalSearch search(map);
+            report_search("bidir", search, map);
+        }
+        else
+        {
+            std::cerr << "Unknown search engine " << engine << " : expected bfs, astar, astar-manhattan, astar-height or bidir" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // One backwards search from the end answers every start cell
+    BfsSearch search(map);
+    search.run_reverse(map.end_coord());
+
+    std::cout << "Path length from S = " << search.distance(map.start_coord()) << std::endl;
+    Distance best_path_length = unreached;
+    for (const auto &sc : map.start_coords())
+    {
+        best_path_length = std::min(best_path_length, search.distance(sc));
+    }
+    std::cout << "Best path length = " << best_path_length << std::endl;
+
     return 0;
-}
\ No newline at end of file
+}
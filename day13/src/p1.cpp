@@ -1,15 +1,22 @@
 #include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <cstring>
 #include <deque>
+#include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
 #include <set>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 enum ORDER_STATUS
@@ -19,243 +26,848 @@ enum ORDER_STATUS
     KEEP_LOOKING
 };
 
-class MessageItemInt;
-class MessageItemList;
+// Packets are stored flattened in preorder as a run of tagged nodes. A
+// list is a PACKET_LIST_START node, its items, then a PACKET_LIST_END node.
+enum PACKET_TAG : uint8_t
+{
+    PACKET_INT,
+    PACKET_LIST_START,
+    PACKET_LIST_END
+};
+
+struct PacketNode
+{
+    PACKET_TAG tag_;
+    uint32_t value_;  // PACKET_INT : the int, PACKET_LIST_START : number of items in the list
+    uint32_t offset_; // PACKET_LIST_START : distance to the matching PACKET_LIST_END
+};
 
-class MessageItem
+// Backing store for all the packets read from a file. Every node needs at
+// least one input character, so sizing it from the input up front means
+// the whole file is parsed with a single allocation.
+class PacketArena
 {
 public:
-    virtual std::string parse_list(std::string str) {return str;}
-    virtual std::string toString(void) const
+    PacketArena(const size_t capacity)
+    {
+        nodes_.reserve(capacity);
+    }
+    uint32_t push(const PacketNode &node)
+    {
+        nodes_.push_back(node);
+        return nodes_.size() - 1;
+    }
+    PacketNode &operator[](const uint32_t idx)
+    {
+        return nodes_[idx];
+    }
+    const PacketNode &operator[](const uint32_t idx) const
+    {
+        return nodes_[idx];
+    }
+    uint32_t size() const
     {
-        return std::string();
+        return nodes_.size();
     }
-    virtual ORDER_STATUS compare(const MessageItemInt &rhs) const = 0;
-    virtual ORDER_STATUS compare(const MessageItemList &rhs) const = 0;
-    friend std::ostream &operator<<(std::ostream &os, const MessageItem &m);
 
+private:
+    std::vector<PacketNode> nodes_;
 };
-std::ostream &operator<<(std::ostream &os, const MessageItem &m)
+
+// Returns the node following the item starting at node
+inline const PacketNode *next_item(const PacketNode *node)
 {
-    os << m.toString();
-    return os;
+    return (node->tag_ == PACKET_LIST_START) ? (node + node->offset_ + 1) : (node + 1);
 }
-class MessageItemInt : public MessageItem
+
+// Compare two packets by walking their node streams in lockstep, with no
+// recursion and no allocation. Where one side has an int and the other a
+// list start, the int is treated as a one item list : the list start is
+// stepped over, and a matching virtual list end is owed on the int's side
+// once the int itself has been compared. Both sides are then always at the
+// same depth, so the walk is done when the outer lists close together.
+ORDER_STATUS compare_packets(const PacketNode *lhs, const PacketNode *rhs)
 {
-public:
-        MessageItemInt(const std::string &string)
-            : item_(atoi(string.c_str()))
+    // Virtual lists the current int on each side is wrapped in, and
+    // virtual list ends still owed after an int which has been compared
+    uint32_t lhs_wraps = 0;
+    uint32_t rhs_wraps = 0;
+    uint32_t lhs_ends = 0;
+    uint32_t rhs_ends = 0;
+    size_t depth = 0;
+    do
+    {
+        const PACKET_TAG l = lhs_ends ? PACKET_LIST_END : lhs->tag_;
+        const PACKET_TAG r = rhs_ends ? PACKET_LIST_END : rhs->tag_;
+        if ((l == PACKET_LIST_END) || (r == PACKET_LIST_END))
         {
+            if (l != r)
+            {
+                // One side ran out of items first
+                return (l == PACKET_LIST_END) ? IN_RIGHT_ORDER : IN_WRONG_ORDER;
+            }
+            if (lhs_ends)
+            {
+                lhs_ends -= 1;
+            }
+            else
+            {
+                lhs += 1;
+            }
+            if (rhs_ends)
+            {
+                rhs_ends -= 1;
+            }
+            else
+            {
+                rhs += 1;
+            }
+            depth -= 1;
         }
-        MessageItemInt(const int v)
-        : item_(v)
+        else if ((l == PACKET_LIST_START) && (r == PACKET_LIST_START))
         {
+            lhs += 1;
+            rhs += 1;
+            depth += 1;
         }
-        std::string toString(void) const override
+        else if (l == PACKET_LIST_START)
         {
-            return std::to_string(item_);
+            lhs += 1;
+            rhs_wraps += 1;
+            depth += 1;
         }
-
-        ORDER_STATUS compare(const MessageItemInt &rhs) const
+        else if (r == PACKET_LIST_START)
+        {
+            rhs += 1;
+            lhs_wraps += 1;
+            depth += 1;
+        }
+        else
         {
-            //std::cout << "Compare " << *this << " vs " << rhs << std::endl;
-            if (item_ < rhs.item_)
+            if (lhs->value_ < rhs->value_)
             {
-                //std::cout << " Left side is smaller, so inputs are in ther right order" << std::endl;
                 return IN_RIGHT_ORDER;
             }
-            if (item_ > rhs.item_)
+            if (lhs->value_ > rhs->value_)
             {
-                //std::cout << " Right side is smaller, so inputs are not in the right order" << std::endl;
                 return IN_WRONG_ORDER;
             }
-            return KEEP_LOOKING;
+            lhs += 1;
+            rhs += 1;
+            lhs_ends = lhs_wraps;
+            rhs_ends = rhs_wraps;
+            lhs_wraps = 0;
+            rhs_wraps = 0;
         }
+    } while (depth);
+    return KEEP_LOOKING;
+}
 
-        ORDER_STATUS compare(const MessageItemList &rhs) const;
-        int value() const {return item_;}
-private:
-    int item_;
+// Encode a packet as a byte string whose memcmp order is the packet order,
+// so packets can be sorted and searched without running the comparator.
+//
+// The int vs list rule means list starts are transparent when the other
+// side has an int, so only these matter while walking two packets :
+//  - each int, compared by value
+//  - each empty list, which is below any int, and deeper ones are larger
+//  - how far the depth drops in the run of list ends after each of those -
+//    a side which closes more lists there ran out of items first, so the
+//    depth left after the run is what is compared
+// The key is that sequence of items, each followed by the depth after its
+// run of list ends. Fields are fixed width big endian so bytes compare in
+// the same order as the fields.
+enum ORDER_KEY_TAG : uint8_t
+{
+    ORDER_KEY_EMPTY_LIST = 1,
+    ORDER_KEY_INT = 2
 };
 
-class MessageItemList : public MessageItem
+inline void append_be32(std::string &key, const uint32_t value)
+{
+    key += static_cast<char>(value >> 24);
+    key += static_cast<char>(value >> 16);
+    key += static_cast<char>(value >> 8);
+    key += static_cast<char>(value);
+}
+
+std::string order_key(const PacketNode *packet)
+{
+    std::string key;
+    const PacketNode *const end = next_item(packet);
+    const PacketNode *node = packet;
+    uint32_t depth = 0;
+    while (node != end)
+    {
+        if (node->tag_ == PACKET_LIST_START)
+        {
+            depth += 1;
+            node += 1;
+            if (node->tag_ != PACKET_LIST_END)
+            {
+                continue;
+            }
+            key += static_cast<char>(ORDER_KEY_EMPTY_LIST);
+            append_be32(key, depth);
+        }
+        else
+        {
+            key += static_cast<char>(ORDER_KEY_INT);
+            append_be32(key, node->value_);
+            node += 1;
+        }
+        while ((node != end) && (node->tag_ == PACKET_LIST_END))
+        {
+            depth -= 1;
+            node += 1;
+        }
+        append_be32(key, depth);
+    }
+    return key;
+}
+
+// A packet is a view of its nodes in an arena. The arena is referenced
+// by index rather than pointer so it is free to grow after parsing.
+class Message
 {
 public:
-    MessageItemList()
+    Message(const std::string_view str, PacketArena &arena)
+        : arena_(&arena)
+        , begin_(arena.size())
     {
+        parse(str, arena);
     }
-    MessageItemList(const MessageItemInt &other)
+    ORDER_STATUS compare(const Message &rhs) const
     {
-        items_.push_back(std::make_unique<MessageItemInt>(other.value()));
+        return compare_packets(nodes(), rhs.nodes());
     }
-    std::string parse_int(const std::string &str)
+    bool operator<(const Message &rhs) const
     {
-        items_.push_back(std::make_unique<MessageItemInt>(str));
-        size_t idx = 0;
-        while (isdigit(str[idx]))
-        {
-            idx += 1;
-        }
-        return str.substr(idx);
+        return compare(rhs) == IN_RIGHT_ORDER;
     }
-    std::string parse_list(std::string str)
+    bool operator==(const Message &rhs) const
     {
-        while (str.size())
+        return compare(rhs) == KEEP_LOOKING;
+    }
+    const PacketNode *nodes() const
+    {
+        return &(*arena_)[begin_];
+    }
+
+private:
+    // Single pass over the text with a cursor. Nesting is tracked without
+    // recursion or a separate stack : while a list is open its start node's
+    // offset_ holds the index of the enclosing list's start, and is replaced
+    // by the real offset when the list closes.
+    void parse(const std::string_view str, PacketArena &arena)
+    {
+        uint32_t open_list = 0;
+        size_t depth = 0;
+        size_t cursor = 0;
+        while (cursor < str.size())
         {
-            // At end of list, return since this full list is parsed
-            if (str[0] == ']')
+            const char c = str[cursor];
+            if (c == '[')
             {
-                return str.substr(1);
+                if (depth)
+                {
+                    arena[open_list].value_ += 1;
+                }
+                open_list = arena.push(PacketNode{PACKET_LIST_START, 0, open_list});
+                depth += 1;
+                cursor += 1;
             }
-            if (isdigit(str[0]))
+            else if (c == ']')
             {
-                //std::cout << "Parsing int = " << str << std::endl;
-                str = parse_int(str);
-                //std::cout << "After parsing int = " << str << std::endl;
-                if (str[0] == ']')
+                const uint32_t end = arena.push(PacketNode{PACKET_LIST_END, 0, 0});
+                const uint32_t parent = arena[open_list].offset_;
+                arena[open_list].offset_ = end - open_list;
+                open_list = parent;
+                cursor += 1;
+                depth -= 1;
+                if (depth == 0)
                 {
-                    return str.substr(1);
+                    return;
                 }
             }
-            else // start of a new list
+            else if (isdigit(c))
             {
-                //std::cout << "Parsing list = " << str << std::endl;
-                items_.push_back(std::make_unique<MessageItemList>());
-                str = items_.back()->parse_list(str.substr(1));
-                //std::cout << "After parsing list = " << str << std::endl;
+                uint32_t value = 0;
+                while ((cursor < str.size()) && isdigit(str[cursor]))
+                {
+                    value = value * 10 + (str[cursor] - '0');
+                    cursor += 1;
+                }
+                arena[open_list].value_ += 1;
+                arena.push(PacketNode{PACKET_INT, value, 0});
             }
-            // Skip over comma delimiting list entries
-            if (str[0] == ',')
+            else // comma delimiting list entries
             {
-                str = str.substr(1);
+                cursor += 1;
             }
         }
-        return str;
     }
-    std::string toString(void) const override
-    {
-        std::string ret;
-        ret += '[';
 
-        for (const auto &i : items_)
+    const PacketArena *arena_;
+    uint32_t begin_;
+    friend std::ostream &operator<<(std::ostream &os, const Message &m);
+};
+std::ostream &operator<<(std::ostream &os, const Message &m)
+{
+    const PacketNode *node = m.nodes();
+    const PacketNode *end = next_item(node);
+    for (; node != end; node++)
+    {
+        switch (node->tag_)
         {
-            ret += i->toString();
-            ret += ' ';
+        case PACKET_INT:
+            os << node->value_ << ' ';
+            break;
+        case PACKET_LIST_START:
+            os << '[';
+            break;
+        case PACKET_LIST_END:
+            os << ']';
+            if ((node + 1) != end)
+            {
+                os << ' ';
+            }
+            break;
         }
-        ret += ']';
-        return ret;
     }
+    return os;
+}
+
+// Returns the next packet's line from input, starting at cursor and
+// skipping the blank lines between pairs. Empty once input runs out.
+std::string_view next_packet(const std::string_view input, size_t &cursor)
+{
+    while ((cursor < input.size()) && (input[cursor] != '['))
+    {
+        cursor += 1;
+    }
+    const size_t line_end = std::min(input.find('\n', cursor), input.size());
+    const auto ret = input.substr(cursor, line_end - cursor);
+    cursor = line_end;
+    return ret;
+}
+
+// Hash-consed packet store. Every distinct list is stored exactly once, as
+// a run of item references, so identical sub-lists anywhere in any packet
+// share one list id and memory grows with the amount of unique structure
+// rather than the size of the input. Comparing two packets which share a
+// sub-list stops at the matching id, since identical lists always compare
+// as KEEP_LOOKING.
+class PacketTable
+{
+public:
+    // An item is either an int, stored as (value << 1) | 1, or a list,
+    // stored as its id << 1
+    using ItemRef = uint32_t;
+
+    PacketTable()
+        : lookup_(0, ListHash{this}, ListEqual{this})
+    {
+    }
+    // The lookup hashes through this, so the table can't move
+    PacketTable(const PacketTable &) = delete;
+    PacketTable &operator=(const PacketTable &) = delete;
 
-    ORDER_STATUS compare(const MessageItemList &rhs) const
+    // Parse one packet, returning the reference to its outer list
+    ItemRef parse(const std::string_view str)
     {
-        //std::cout << "Compare " << *this << " vs " << rhs << std::endl;
-        for (size_t i = 0; i < items_.size(); i++)
+        // Items of every list still open, innermost last
+        scratch_.clear();
+        open_lists_.clear();
+        size_t cursor = 0;
+        while (cursor < str.size())
         {
-            if (i >= rhs.items_.size())
+            const char c = str[cursor];
+            if (c == '[')
             {
-                //std::cout << "Right side ran out of items, so inputs are not in the right order" << std::endl;
-                return IN_WRONG_ORDER;
+                open_lists_.push_back(scratch_.size());
+                cursor += 1;
             }
-            ORDER_STATUS rc;
-            MessageItemInt *mii = dynamic_cast<MessageItemInt *>(rhs.items_[i].get());
-            if (mii)
+            else if (c == ']')
             {
-                rc = items_[i]->compare(*mii);
+                const ItemRef list = (intern(open_lists_.back()) << 1);
+                scratch_.resize(open_lists_.back());
+                open_lists_.pop_back();
+                cursor += 1;
+                if (open_lists_.empty())
+                {
+                    return list;
+                }
+                scratch_.push_back(list);
             }
-            else
+            else if (isdigit(c))
             {
-                MessageItemList *mil = dynamic_cast<MessageItemList *>(rhs.items_[i].get());
-                rc = items_[i]->compare(*mil);
+                uint32_t value = 0;
+                while ((cursor < str.size()) && isdigit(str[cursor]))
+                {
+                    value = value * 10 + (str[cursor] - '0');
+                    cursor += 1;
+                }
+                scratch_.push_back((value << 1) | 1);
             }
-            if (rc != KEEP_LOOKING)
+            else // comma delimiting list entries
             {
-                return rc;
+                cursor += 1;
             }
         }
-        if (items_.size() < rhs.items_.size())
+        return intern(0) << 1;
+    }
+
+    // Iterative, using a stack of the pairs of lists being walked. An int
+    // compared against a list is viewed as a list holding just that int.
+    // Not thread safe, since the stack is reused between calls.
+    ORDER_STATUS compare(const ItemRef lhs, const ItemRef rhs) const
+    {
+        if (lhs == rhs)
+        {
+            return KEEP_LOOKING;
+        }
+        frames_.clear();
+        frames_.push_back(Frame{lhs, rhs, 0});
+        while (frames_.size())
         {
-            //std::cout << "Left side ran out of items, so inputs are in the right order" << std::endl;
-            return IN_RIGHT_ORDER;
+            Frame &f = frames_.back();
+            const uint32_t lhs_count = item_count(f.lhs_);
+            const uint32_t rhs_count = item_count(f.rhs_);
+            if ((f.pos_ == lhs_count) || (f.pos_ == rhs_count))
+            {
+                if (lhs_count == rhs_count)
+                {
+                    frames_.pop_back();
+                    continue;
+                }
+                // One side ran out of items first
+                return (f.pos_ == lhs_count) ? IN_RIGHT_ORDER : IN_WRONG_ORDER;
+            }
+            const ItemRef l = item(f.lhs_, f.pos_);
+            const ItemRef r = item(f.rhs_, f.pos_);
+            f.pos_ += 1;
+            if (l == r)
+            {
+                // The same int, or the same shared list
+                continue;
+            }
+            if ((l & 1) && (r & 1))
+            {
+                return (l < r) ? IN_RIGHT_ORDER : IN_WRONG_ORDER;
+            }
+            frames_.push_back(Frame{l, r, 0});
         }
         return KEEP_LOOKING;
     }
 
-    ORDER_STATUS compare(const MessageItemInt &rhs) const
+    size_t unique_lists() const
+    {
+        return lists_.size();
+    }
+    size_t stored_items() const
     {
-        //std::cout << "Compare " << *this << " vs " << rhs << std::endl;
-        return compare(MessageItemList(rhs));
+        return items_.size();
     }
+
 private:
-    std::vector<std::unique_ptr<MessageItem>> items_;
+    struct ListEntry
+    {
+        uint32_t first_; // index of the list's first item in items_
+        uint32_t count_;
+    };
+    struct Frame
+    {
+        ItemRef lhs_;
+        ItemRef rhs_;
+        uint32_t pos_;
+    };
+    struct ListHash
+    {
+        const PacketTable *table_;
+        size_t operator()(const uint32_t id) const
+        {
+            const auto &l = table_->lists_[id];
+            size_t hash = l.count_;
+            for (uint32_t i = 0; i < l.count_; i++)
+            {
+                hash ^= table_->items_[l.first_ + i] + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+            }
+            return hash;
+        }
+    };
+    struct ListEqual
+    {
+        const PacketTable *table_;
+        bool operator()(const uint32_t lhs, const uint32_t rhs) const
+        {
+            const auto &l = table_->lists_[lhs];
+            const auto &r = table_->lists_[rhs];
+            return (l.count_ == r.count_) &&
+                   std::equal(table_->items_.cbegin() + l.first_, table_->items_.cbegin() + l.first_ + l.count_,
+                              table_->items_.cbegin() + r.first_);
+        }
+    };
+
+    // Returns the id of the list made of scratch_ items from begin on,
+    // adding it to the table only if an identical list isn't there already
+    uint32_t intern(const size_t begin)
+    {
+        const uint32_t id = lists_.size();
+        lists_.push_back(ListEntry{static_cast<uint32_t>(items_.size()), static_cast<uint32_t>(scratch_.size() - begin)});
+        items_.insert(items_.end(), scratch_.cbegin() + begin, scratch_.cend());
+        const auto it = lookup_.find(id);
+        if (it != lookup_.end())
+        {
+            items_.resize(lists_.back().first_);
+            lists_.pop_back();
+            return *it;
+        }
+        lookup_.insert(id);
+        return id;
+    }
+
+    uint32_t item_count(const ItemRef ref) const
+    {
+        return (ref & 1) ? 1 : lists_[ref >> 1].count_;
+    }
+    ItemRef item(const ItemRef ref, const uint32_t pos) const
+    {
+        return (ref & 1) ? ref : items_[lists_[ref >> 1].first_ + pos];
+    }
+
+    std::vector<ListEntry> lists_;
+    std::vector<ItemRef> items_;
+    std::vector<ItemRef> scratch_;
+    std::vector<size_t> open_lists_;
+    std::unordered_set<uint32_t, ListHash, ListEqual> lookup_;
+    mutable std::vector<Frame> frames_;
 };
 
-ORDER_STATUS MessageItemInt::compare(const MessageItemList &rhs) const
+size_t worker_count(void)
 {
-    //std::cout << "Compare " << *this << " vs " << rhs << std::endl;
-    return MessageItemList(*this).compare(rhs);
+    return std::max(1U, std::thread::hardware_concurrency());
 }
 
-class Message
+// Minimal multi-producer multi-consumer queue. pop() blocks until an
+// item arrives, or returns nullopt once the queue is closed and drained.
+template <typename T>
+class WorkQueue
 {
 public:
-    Message(const std::string &str)
+    void push(T item)
     {
-        message_.parse_list(str.substr(1));
-    }
-    ORDER_STATUS compare(const Message &rhs) const
-    {
-        return message_.compare(rhs.message_);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push(std::move(item));
+        }
+        cv_.notify_one();
     }
-    bool operator<(const Message &rhs) const
+    void close(void)
     {
-        return message_.compare(rhs.message_) == IN_RIGHT_ORDER;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cv_.notify_all();
     }
-    bool operator==(const Message &rhs) const
+    std::optional<T> pop(void)
     {
-        return message_.compare(rhs.message_) == KEEP_LOOKING;
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]() { return !queue_.empty() || closed_; });
+        if (queue_.empty())
+        {
+            return std::nullopt;
+        }
+        T item = std::move(queue_.front());
+        queue_.pop();
+        return item;
     }
 
 private:
-    MessageItemList message_;
-    friend std::ostream &operator<<(std::ostream &os, const Message &m);
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::queue<T> queue_;
+    bool closed_{false};
 };
-std::ostream &operator<<(std::ostream &os, const Message &m)
+
+// A run of consecutive packet pairs, parsed into their own arena so
+// batches can be worked on independently
+struct PairBatch
 {
-    os << m.message_;
-    return os;
+    size_t first_index_;                // 1 based index of the first pair
+    std::vector<std::string_view> lines_; // two per pair
+    std::optional<PacketArena> arena_;
+    std::vector<Message> packets_;
+    std::vector<ORDER_STATUS> order_;   // one per pair
+};
+
+struct PairResults
+{
+    std::deque<PairBatch> batches_; // owns the arenas the packets point into
+    std::vector<ORDER_STATUS> order_;
+    std::vector<Message> packets_;
+    size_t index_sum_{0};
+};
+
+// Check the order of every pair in the input with a two stage pipeline. A
+// reader thread splits the input into batches of pairs and queues them,
+// while a pool of workers parse and compare each batch as it arrives.
+// Returns the order of each pair, every packet in input order and the sum
+// of the indices of the pairs in the right order.
+PairResults check_pairs(const std::string_view input, const size_t batch_pairs)
+{
+    PairResults results;
+    WorkQueue<PairBatch *> queue;
+
+    std::thread reader([&]() {
+        size_t cursor = 0;
+        size_t index = 1;
+        bool done = false;
+        while (!done)
+        {
+            // Batches are only ever appended, so the addresses of queued ones stay valid
+            PairBatch &batch = results.batches_.emplace_back();
+            batch.first_index_ = index;
+            while (batch.lines_.size() < (2 * batch_pairs))
+            {
+                const auto line1 = next_packet(input, cursor);
+                const auto line2 = next_packet(input, cursor);
+                if (line2.empty())
+                {
+                    done = true;
+                    break;
+                }
+                batch.lines_.push_back(line1);
+                batch.lines_.push_back(line2);
+                index += 1;
+            }
+            queue.push(&batch);
+        }
+        queue.close();
+    });
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < worker_count(); t++)
+    {
+        workers.emplace_back([&]() {
+            for (auto batch = queue.pop(); batch; batch = queue.pop())
+            {
+                PairBatch &b = **batch;
+                size_t capacity = 0;
+                for (const auto &l : b.lines_)
+                {
+                    capacity += l.size();
+                }
+                b.arena_.emplace(capacity);
+                for (const auto &l : b.lines_)
+                {
+                    b.packets_.emplace_back(l, *b.arena_);
+                }
+                for (size_t i = 0; i < b.packets_.size(); i += 2)
+                {
+                    b.order_.push_back(b.packets_[i].compare(b.packets_[i + 1]));
+                }
+            }
+        });
+    }
+    reader.join();
+    for (auto &w : workers)
+    {
+        w.join();
+    }
+
+    for (const auto &b : results.batches_)
+    {
+        for (size_t i = 0; i < b.order_.size(); i++)
+        {
+            if (b.order_[i] == IN_RIGHT_ORDER)
+            {
+                results.index_sum_ += b.first_index_ + i;
+            }
+        }
+        results.order_.insert(results.order_.end(), b.order_.cbegin(), b.order_.cend());
+        results.packets_.insert(results.packets_.end(), b.packets_.cbegin(), b.packets_.cend());
+    }
+    return results;
+}
+
+// Merge sort across threads : each thread sorts one chunk, then pairs of
+// neighboring sorted runs are merged in parallel until one run is left
+template <typename T>
+void parallel_sort(std::vector<T> &v)
+{
+    const size_t thread_count = worker_count();
+    const size_t chunk_size = std::max<size_t>(1, (v.size() + thread_count - 1) / thread_count);
+    std::vector<size_t> bounds;
+    for (size_t b = 0; b < v.size(); b += chunk_size)
+    {
+        bounds.push_back(b);
+    }
+    bounds.push_back(v.size());
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; (i + 1) < bounds.size(); i++)
+    {
+        threads.emplace_back([&, i]() { std::sort(v.begin() + bounds[i], v.begin() + bounds[i + 1]); });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+
+    while (bounds.size() > 2)
+    {
+        threads.clear();
+        std::vector<size_t> merged_bounds;
+        for (size_t i = 0; (i + 1) < bounds.size(); i += 2)
+        {
+            merged_bounds.push_back(bounds[i]);
+            if ((i + 2) < bounds.size())
+            {
+                threads.emplace_back([&, i]() {
+                    std::inplace_merge(v.begin() + bounds[i], v.begin() + bounds[i + 1], v.begin() + bounds[i + 2]);
+                });
+            }
+        }
+        merged_bounds.push_back(v.size());
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        bounds = merged_bounds;
+    }
+}
+
+// Returns the 1 based position each probe would have if the probes were
+// added to packets and the lot sorted - one more than the number of packets
+// and other probes which compare less than it. That only needs each packet
+// compared against each probe once, so there is no sort and no copying,
+// and the packets are split across threads which each count into their
+// own totals.
+std::vector<size_t> probe_ranks(const std::vector<Message> &packets, const std::vector<Message> &probes)
+{
+    const size_t thread_count = worker_count();
+    const size_t chunk_size = (packets.size() + thread_count - 1) / thread_count;
+    std::vector<std::vector<size_t>> less_counts(thread_count, std::vector<size_t>(probes.size(), 0));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; t++)
+    {
+        threads.emplace_back([&, t]() {
+            const size_t begin = std::min(t * chunk_size, packets.size());
+            const size_t end = std::min(begin + chunk_size, packets.size());
+            auto &counts = less_counts[t];
+            for (size_t i = begin; i < end; i++)
+            {
+                for (size_t p = 0; p < probes.size(); p++)
+                {
+                    counts[p] += packets[i] < probes[p];
+                }
+            }
+        });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+
+    std::vector<size_t> ranks(probes.size(), 1);
+    for (size_t p = 0; p < probes.size(); p++)
+    {
+        for (const auto &counts : less_counts)
+        {
+            ranks[p] += counts[p];
+        }
+        for (const auto &other : probes)
+        {
+            ranks[p] += other < probes[p];
+        }
+    }
+    return ranks;
 }
 
 int main(int argc, char **argv)
 {
-    std::ifstream istream(argv[1], std::ifstream::in);
-    std::string line;
-    size_t index = 1;
-    size_t sum = 0;
-    std::vector<Message> messages;
+    // Read the whole file in one go and parse packets straight out of it
+    std::ifstream istream(argv[1], std::ifstream::in | std::ifstream::binary);
+    std::string input(std::filesystem::file_size(argv[1]), '\0');
+    istream.read(input.data(), input.size());
+
+    const std::string_view divider1("[[2]]");
+    const std::string_view divider2("[[6]]");
+    PacketArena arena(divider1.size() + divider2.size());
 
-    while (getline(istream, line))
+    // "dedup" parses into a hash-consed table instead, sharing identical
+    // sub-lists, and reports how much structure was unique
+    if ((argc > 2) && (std::string_view(argv[2]) == "dedup"))
     {
-        messages.emplace_back(Message(line));
-        getline(istream, line);
-        messages.emplace_back(Message(line));
+        PacketTable table;
+        std::vector<PacketTable::ItemRef> packets;
+        size_t cursor = 0;
+        size_t sum = 0;
+        for (size_t index = 1; true; index++)
+        {
+            const auto line1 = next_packet(input, cursor);
+            const auto line2 = next_packet(input, cursor);
+            if (line2.empty())
+            {
+                break;
+            }
+            packets.push_back(table.parse(line1));
+            packets.push_back(table.parse(line2));
+            if (table.compare(packets[packets.size() - 2], packets.back()) == IN_RIGHT_ORDER)
+            {
+                sum += index;
+            }
+        }
+        std::cout << "Index sum = " << sum << std::endl;
 
-        getline(istream, line);
-        //std::cout << " == Pair " << index << " ==" << std::endl;
-        if (messages[messages.size() - 2].compare(messages[messages.size() -1]) == IN_RIGHT_ORDER)
+        const std::array<PacketTable::ItemRef, 2> dividers = {table.parse(divider1), table.parse(divider2)};
+        size_t product = 1;
+        for (const auto d : dividers)
         {
-            sum += index;
+            size_t rank = 1;
+            for (const auto p : packets)
+            {
+                rank += table.compare(p, d) == IN_RIGHT_ORDER;
+            }
+            for (const auto other : dividers)
+            {
+                rank += table.compare(other, d) == IN_RIGHT_ORDER;
+            }
+            product *= rank;
         }
-        index += 1;
-    }
-    std::cout << "Index sum = " << sum << std::endl;
-    messages.emplace_back("[[2]]");
-    messages.emplace_back("[[6]]");
-    std::sort(messages.begin(), messages.end());
-    std::copy(messages.cbegin(), messages.cend(), std::ostream_iterator<Message>(std::cout, "\n"));
-    const auto it1 = std::find(messages.cbegin(), messages.cend(), Message("[[2]]"));
-    const auto it2 = std::find(messages.cbegin(), messages.cend(), Message("[[6]]"));
-    const size_t product = (1 + std::distance(messages.cbegin(), it1)) * (1 + std::distance(messages.cbegin(), it2));
-    
-    std::cout << "Index product = " << product << std::endl;
+        std::cout << "Index product = " << product << std::endl;
+        std::cout << packets.size() << " packets stored as " << table.unique_lists() << " unique lists holding "
+                  << table.stored_items() << " items" << std::endl;
+        return 0;
+    }
+
+    constexpr size_t batch_pairs = 256;
+    auto pairs = check_pairs(input, batch_pairs);
+    std::cout << "Index sum = " << pairs.index_sum_ << std::endl;
+    auto &messages = pairs.packets_;
+
+    // Only the dividers' positions are needed, so rank them directly
+    const std::vector<Message> dividers = {Message(divider1, arena), Message(divider2, arena)};
+    const auto ranks = probe_ranks(messages, dividers);
+    std::cout << "Index product = " << ranks[0] * ranks[1] << std::endl;
+
+    // "sorted" lists every packet in order, sorted by order key rather
+    // than with the packet comparator
+    if ((argc > 2) && (std::string_view(argv[2]) == "sorted"))
+    {
+        messages.insert(messages.end(), dividers.cbegin(), dividers.cend());
+        std::vector<std::pair<std::string, size_t>> keys;
+        keys.reserve(messages.size());
+        for (size_t i = 0; i < messages.size(); i++)
+        {
+            keys.emplace_back(order_key(messages[i].nodes()), i);
+        }
+        parallel_sort(keys);
+        for (const auto &k : keys)
+        {
+            std::cout << messages[k.second] << std::endl;
+        }
+    }
     return 0;
 }
\ No newline at end of file
@@ -1,263 +1,1056 @@
 #include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <cstring>
+#include <fcntl.h>
 #include <deque>
-#include <fstream>
 #include <functional>
 #include <ios>
 #include <iostream>
 #include <iterator>
-#include <map>
-#include <memory>
 #include <numeric>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
 #include <set>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <thread>
+#include <unistd.h>
 #include <vector>
 
-class NodeBase;
-using SymTab = std::map<std::string, std::shared_ptr<NodeBase>>;
-class NodeBase
+// Operations of the compiled program, see Program below
+enum OPCODE : uint8_t
 {
-public:
-    NodeBase() = default;
-
-    virtual long long process(void) const = 0;
-    virtual void build_tree(const SymTab &symtab) = 0;
-    virtual void set_subvalue(const long long input_value) const = 0;
-    virtual bool is_humn(void) const = 0;
-private:
+    OP_CONST,
+    OP_HUMN,
+    OP_ADD,
+    OP_SUBTRACT,
+    OP_MULTIPLY,
+    OP_DIVIDE
 };
 
-class LeafNode : public NodeBase
+__extension__ typedef __int128 int128;
+
+std::string to_string(int128 v)
 {
-public:
-    LeafNode(const long long value)
-    : value_(value)
+    if (v == 0)
+    {
+        return "0";
+    }
+    const bool negative = v < 0;
+    std::string ret;
+    for (; v; v /= 10)
     {
+        ret += static_cast<char>('0' + (negative ? -(v % 10) : (v % 10)));
+    }
+    if (negative)
+    {
+        ret += '-';
+    }
+    std::reverse(ret.begin(), ret.end());
+    return ret;
+}
 
+// Exact fraction, always kept in lowest terms with a positive denominator.
+// Arithmetic is checked : a result which doesn't fit in 128 bits, or any
+// result computed from one, is flagged with overflow() rather than being
+// silently wrong.
+struct Rational
+{
+    int128 num_{0};
+    int128 den_{1};
+    bool overflow_{false};
+
+    Rational() = default;
+    Rational(const int128 num, const int128 den = 1, const bool overflow = false)
+        : num_(num), den_(den), overflow_(overflow)
+    {
+        reduce();
     }
-    void build_tree(const SymTab &symtab) override
+    Rational operator+(const Rational &rhs) const
     {
+        int128 l, r, num, den;
+        const bool overflow = __builtin_mul_overflow(num_, rhs.den_, &l) ||
+                              __builtin_mul_overflow(rhs.num_, den_, &r) ||
+                              __builtin_add_overflow(l, r, &num) ||
+                              __builtin_mul_overflow(den_, rhs.den_, &den);
+        return combine(rhs, overflow, num, den);
     }
-    long long process(void) const override
+    Rational operator-(const Rational &rhs) const
     {
-        return value_;
+        int128 l, r, num, den;
+        const bool overflow = __builtin_mul_overflow(num_, rhs.den_, &l) ||
+                              __builtin_mul_overflow(rhs.num_, den_, &r) ||
+                              __builtin_sub_overflow(l, r, &num) ||
+                              __builtin_mul_overflow(den_, rhs.den_, &den);
+        return combine(rhs, overflow, num, den);
     }
-    virtual void set_subvalue(const long long input_value) const override
+    Rational operator*(const Rational &rhs) const
     {
+        int128 num, den;
+        const bool overflow = __builtin_mul_overflow(num_, rhs.num_, &num) ||
+                              __builtin_mul_overflow(den_, rhs.den_, &den);
+        return combine(rhs, overflow, num, den);
     }
-    virtual bool is_humn(void) const override { return false;}
+    Rational operator/(const Rational &rhs) const
+    {
+        int128 num, den;
+        const bool overflow = __builtin_mul_overflow(num_, rhs.den_, &num) ||
+                              __builtin_mul_overflow(den_, rhs.num_, &den);
+        return combine(rhs, overflow, num, den);
+    }
+    bool is_zero(void) const { return num_ == 0; }
+    bool overflow(void) const { return overflow_; }
+
 private:
-    long long value_;
-};
+    Rational combine(const Rational &rhs, const bool overflow, const int128 num, const int128 den) const
+    {
+        if (overflow || overflow_ || rhs.overflow_)
+        {
+            return Rational(0, 1, true);
+        }
+        return Rational(num, den);
+    }
 
-class HumnNode : public LeafNode
+    void reduce(void)
+    {
+        constexpr int128 min = std::numeric_limits<int128>::min();
+        if ((num_ == min) || (den_ == min) || (den_ == 0))
+        {
+            overflow_ = true;
+        }
+        if (overflow_)
+        {
+            num_ = 0;
+            den_ = 1;
+            return;
+        }
+        if (den_ < 0)
+        {
+            num_ = -num_;
+            den_ = -den_;
+        }
+        int128 a = (num_ < 0) ? -num_ : num_;
+        int128 b = den_;
+        while (b)
+        {
+            const int128 t = a % b;
+            a = b;
+            b = t;
+        }
+        if (a > 1)
+        {
+            num_ /= a;
+            den_ /= a;
+        }
+    }
+};
+std::ostream &operator<<(std::ostream &os, const Rational &r)
 {
-public:
-    HumnNode()
-    : LeafNode(-1)
+    os << to_string(r.num_);
+    if (r.den_ != 1)
     {
+        os << "/" << to_string(r.den_);
     }
-    void set_subvalue(const long long input_value) const override
+    return os;
+}
+
+// Monkey names are always four lower case letters, so each one packs
+// into a number below 26^4 which can index a flat table directly
+constexpr uint32_t name_count = 26 * 26 * 26 * 26;
+constexpr uint32_t name_code(const char *name)
+{
+    return (((name[0] - 'a') * 26 + (name[1] - 'a')) * 26 + (name[2] - 'a')) * 26 + (name[3] - 'a');
+}
+std::string name_string(uint32_t code)
+{
+    std::string ret(4, 'a');
+    for (int i = 3; i >= 0; i--, code /= 26)
     {
-        std::cout << "humn = " << input_value << std::endl;
+        ret[i] = 'a' + code % 26;
     }
-    bool is_humn(void) const override { return true; }
+    return ret;
+}
+
+// One monkey. Children are indexes into MonkeyGraph's node vector.
+struct MonkeyNode
+{
+    OPCODE op_{OP_CONST};
+    bool defined_{false};
+    uint32_t left_{0};
+    uint32_t right_{0};
+    long long value_{0};
+    uint32_t name_{0}; // name_code() of the monkey's name
 };
 
-class ArithmeticNode: public NodeBase
+// Read-only view of a whole file mapped into memory
+class MappedFile
 {
 public:
-    ArithmeticNode(const std::string &left_label, const std::string &right_label)
-        : left_label_(left_label), right_label_(right_label)
+    MappedFile(const char *path)
     {
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            return;
+        }
+        struct stat st;
+        if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+        {
+            void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                data_ = static_cast<const char *>(data);
+                size_ = st.st_size;
+                madvise(data, size_, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
     }
-    void build_tree(const SymTab &symtab) override
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile()
     {
-        left_node_ = symtab.at(left_label_);
-        right_node_ = symtab.at(right_label_);
+        if (data_)
+        {
+            munmap(const_cast<char *>(data_), size_);
+        }
     }
+    const char *begin(void) const { return data_; }
+    const char *end(void) const { return data_ + size_; }
+    bool valid(void) const { return data_ != nullptr; }
+
+private:
+    const char *data_{nullptr};
+    size_t size_{0};
+};
 
-    virtual long long process(void) const = 0;
-    virtual void set_subvalue(const long long input_value) const = 0;
-    bool is_humn(void) const override
+// All the monkeys in one contiguous vector. Every line is a fixed layout,
+//   abcd: 1234
+//   abcd: efgh + ijkl
+// so fields are read at known offsets. A monkey gets its node index the
+// first time its name is seen, either as a definition or as an operand,
+// which lets children be linked up in the same single pass.
+class MonkeyGraph
+{
+public:
+    MonkeyGraph()
+        : index_(name_count, no_node)
     {
-        return left_node_->is_humn() || right_node_->is_humn();
     }
 
-private:
-    std::string left_label_;
-    std::string right_label_;
-protected:
-    bool left_is_humn(void) const
+    // Returns false, after reporting why, on a malformed line or if a
+    // monkey is used but never defined
+    bool parse(const char *p, const char *end)
     {
-        return left_node_->is_humn();
+        while (p < end)
+        {
+            const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+            if (!eol)
+            {
+                eol = end;
+            }
+            if (eol == p)
+            {
+                p = eol + 1;
+                continue;
+            }
+            // Check every field before any name is used as an index
+            const bool number = ((eol - p) >= 7) && isdigit(p[6]);
+            const bool operation = ((eol - p) >= 17) && valid_name(p + 6) && (p[10] == ' ') &&
+                                   opcode_for(p[11]) && (p[12] == ' ') && valid_name(p + 13);
+            if (((eol - p) < 6) || !valid_name(p) || (p[4] != ':') || (p[5] != ' ') || (!number && !operation))
+            {
+                std::cerr << "Malformed line : " << std::string(p, eol) << std::endl;
+                return false;
+            }
+            const uint32_t id = intern(p);
+            MonkeyNode &node = nodes_[id];
+            node.defined_ = true;
+            if (number)
+            {
+                long long value = 0;
+                for (const char *d = p + 6; (d < eol) && isdigit(*d); d++)
+                {
+                    value = value * 10 + (*d - '0');
+                }
+                node.op_ = (id == humn_) ? OP_HUMN : OP_CONST;
+                node.value_ = value;
+            }
+            else
+            {
+                node.op_ = *opcode_for(p[11]);
+                // intern may grow nodes_, so don't hold on to node
+                const uint32_t left = intern(p + 6);
+                const uint32_t right = intern(p + 13);
+                nodes_[id].left_ = left;
+                nodes_[id].right_ = right;
+            }
+            p = eol + 1;
+        }
+        for (uint32_t code = 0; code < name_count; code++)
+        {
+            if ((index_[code] != no_node) && !nodes_[index_[code]].defined_)
+            {
+                std::cerr << "Monkey " << name_string(code) << " is never defined" << std::endl;
+                return false;
+            }
+        }
+        return true;
     }
-    std::shared_ptr<NodeBase> left_node_;
-    std::shared_ptr<NodeBase> right_node_;
-};
 
-class AddNode : public ArithmeticNode
-{
-public: 
-    AddNode(const std::string &left_label, const std::string &right_label)
-    : ArithmeticNode(left_label, right_label)
+    static constexpr uint32_t no_node = std::numeric_limits<uint32_t>::max();
+    uint32_t find(const char *name) const { return index_[name_code(name)]; }
+    const std::vector<MonkeyNode> &nodes(void) const { return nodes_; }
+
+private:
+    uint32_t intern(const char *name)
     {
+        uint32_t &id = index_[name_code(name)];
+        if (id == no_node)
+        {
+            id = nodes_.size();
+            nodes_.emplace_back();
+            nodes_.back().name_ = name_code(name);
+            if (memcmp(name, "humn", 4) == 0)
+            {
+                humn_ = id;
+            }
+        }
+        return id;
     }
-    long long process(void) const override
+
+    // Names must be exactly four lower case letters for name_code()
+    static bool valid_name(const char *name)
     {
-        return left_node_->process() + right_node_->process();
+        return std::all_of(name, name + 4, [](const char c)
+                           { return (c >= 'a') && (c <= 'z'); });
     }
-    void set_subvalue(const long long input_value) const override
+
+    static std::optional<OPCODE> opcode_for(const char op)
     {
-        if (left_is_humn())
+        switch (op)
         {
-            left_node_->set_subvalue(input_value - right_node_->process());
+        case '+':
+            return OP_ADD;
+        case '-':
+            return OP_SUBTRACT;
+        case '*':
+            return OP_MULTIPLY;
+        case '/':
+            return OP_DIVIDE;
         }
-        else
+        return std::nullopt;
+    }
+
+    std::vector<uint32_t> index_;
+    std::vector<MonkeyNode> nodes_;
+    uint32_t humn_{no_node};
+};
+
+// Arithmetic policies for Program::evaluate_as(). Each operation stores
+// its result and returns false if it couldn't be represented. Unchecked
+// policies return a constant true, so the checks compile away entirely.
+struct UncheckedPolicy
+{
+    using Value = long long;
+    static constexpr const char *name = "unchecked";
+    static bool add(const Value a, const Value b, Value &r) { r = a + b; return true; }
+    static bool subtract(const Value a, const Value b, Value &r) { r = a - b; return true; }
+    static bool multiply(const Value a, const Value b, Value &r) { r = a * b; return true; }
+    static bool divide(const Value a, const Value b, Value &r) { r = a / b; return true; }
+};
+
+struct CheckedPolicy
+{
+    using Value = long long;
+    static constexpr const char *name = "checked";
+    static bool add(const Value a, const Value b, Value &r) { return !__builtin_add_overflow(a, b, &r); }
+    static bool subtract(const Value a, const Value b, Value &r) { return !__builtin_sub_overflow(a, b, &r); }
+    static bool multiply(const Value a, const Value b, Value &r) { return !__builtin_mul_overflow(a, b, &r); }
+    static bool divide(const Value a, const Value b, Value &r)
+    {
+        if ((b == 0) || ((a == std::numeric_limits<Value>::min()) && (b == -1)))
         {
-            right_node_->set_subvalue(input_value - left_node_->process());
+            return false;
         }
+        r = a / b;
+        return true;
     }
 };
-class SubtractNode : public ArithmeticNode
+
+// 128 bit values, for chains which overflow 64 bits. Still unchecked.
+struct WidePolicy
+{
+    using Value = int128;
+    static constexpr const char *name = "wide";
+    static bool add(const Value a, const Value b, Value &r) { r = a + b; return true; }
+    static bool subtract(const Value a, const Value b, Value &r) { r = a - b; return true; }
+    static bool multiply(const Value a, const Value b, Value &r) { r = a * b; return true; }
+    static bool divide(const Value a, const Value b, Value &r) { r = a / b; return true; }
+};
+
+// The tree compiled into a flat array of instructions in postorder, so
+// every instruction's operands come before it. Operands refer to other
+// instructions by index, and evaluating the whole program is a single
+// loop which leaves the value of every node cached in values_.
+class Program
 {
-public: 
-    SubtractNode(const std::string &left_label, const std::string &right_label)
-    : ArithmeticNode(left_label, right_label)
+public:
+    struct Instruction
+    {
+        OPCODE op_;
+        uint32_t lhs_;
+        uint32_t rhs_;
+        long long value_; // OP_CONST / OP_HUMN only
+    };
+
+    // Topologically sort the nodes reachable from root without recursion.
+    // Nodes shared between several parents are only compiled once.
+    // A node reached again while its own operands are still being compiled
+    // (in progress) means the monkeys form a cycle : compiling stops there
+    // and cycle() returns that node.
+    Program(const std::vector<MonkeyNode> &nodes, const uint32_t root)
+        : slots_(nodes.size(), no_slot)
     {
+        std::vector<bool> in_progress(nodes.size());
+        std::vector<std::pair<uint32_t, bool>> stack;
+        stack.emplace_back(root, false);
+        while (stack.size())
+        {
+            const auto [id, children_done] = stack.back();
+            stack.pop_back();
+            if (slots_[id] != no_slot)
+            {
+                continue;
+            }
+            if (!children_done && in_progress[id])
+            {
+                cycle_ = id;
+                return;
+            }
+            const MonkeyNode &node = nodes[id];
+            const bool leaf = (node.op_ == OP_CONST) || (node.op_ == OP_HUMN);
+            if (children_done || leaf)
+            {
+                in_progress[id] = false;
+                slots_[id] = code_.size();
+                node_of_slot_.push_back(id);
+                code_.push_back(Instruction{node.op_,
+                                            leaf ? 0 : slots_[node.left_],
+                                            leaf ? 0 : slots_[node.right_],
+                                            node.value_});
+                continue;
+            }
+            in_progress[id] = true;
+            stack.emplace_back(id, true);
+            stack.emplace_back(node.right_, false);
+            stack.emplace_back(node.left_, false);
+        }
+        values_.resize(code_.size());
+
+        // Which values depend on humn never changes, so work it out once
+        // here in a single bottom up pass rather than on every query
+        depends_on_humn_.resize(code_.size());
+        for (size_t i = 0; i < code_.size(); i++)
+        {
+            const Instruction &ins = code_[i];
+            depends_on_humn_[i] = (ins.op_ == OP_HUMN) ||
+                                  ((ins.op_ != OP_CONST) && (depends_on_humn_[ins.lhs_] || depends_on_humn_[ins.rhs_]));
+        }
+
+        // Back links from each instruction to the ones using its value,
+        // stored compressed : the parents of slot i are
+        // parents_[parent_start_[i]] to parents_[parent_start_[i + 1] - 1].
+        // A node shared between monkeys has several parents, and one used
+        // for both operands is listed twice, which refresh() tolerates.
+        parent_start_.assign(code_.size() + 1, 0);
+        for (const auto &ins : code_)
+        {
+            if ((ins.op_ != OP_CONST) && (ins.op_ != OP_HUMN))
+            {
+                parent_start_[ins.lhs_ + 1] += 1;
+                parent_start_[ins.rhs_ + 1] += 1;
+            }
+        }
+        std::partial_sum(parent_start_.begin(), parent_start_.end(), parent_start_.begin());
+        parents_.resize(parent_start_.back());
+        std::vector<uint32_t> fill(parent_start_.begin(), parent_start_.end() - 1);
+        for (uint32_t i = 0; i < code_.size(); i++)
+        {
+            const Instruction &ins = code_[i];
+            if ((ins.op_ != OP_CONST) && (ins.op_ != OP_HUMN))
+            {
+                parents_[fill[ins.lhs_]++] = i;
+                parents_[fill[ins.rhs_]++] = i;
+            }
+        }
+        queued_.resize(code_.size());
     }
-    long long process(void) const override
+
+    void evaluate(void)
     {
-        return left_node_->process() - right_node_->process();
+        for (size_t i = 0; i < code_.size(); i++)
+        {
+            values_[i] = execute(code_[i]);
+        }
+        pending_ = decltype(pending_){};
+        std::fill(queued_.begin(), queued_.end(), false);
     }
-    void set_subvalue(const long long input_value) const override
+
+    // Same result as evaluate(), computed by a pool of threads. Each
+    // instruction counts down its outstanding operands atomically, and
+    // whichever thread finishes the last operand runs it next, so every
+    // node is evaluated exactly once however many parents share it. Every
+    // thread has its own deque of ready instructions, working LIFO from
+    // the back and stealing from the front of the others' when it runs
+    // dry. Pays off on wide graphs : a long chain is still serial.
+    void evaluate_parallel(const size_t thread_count)
     {
-        if (left_is_humn())
+        struct alignas(64) ReadyDeque
         {
-            left_node_->set_subvalue(input_value + right_node_->process());
+            std::mutex lock_;
+            std::deque<uint32_t> slots_;
+        };
+        const size_t threads = std::max<size_t>(1, thread_count);
+        std::vector<ReadyDeque> ready(threads);
+        // Operand counts come from the parent links, so an instruction
+        // using one value for both operands waits for it twice
+        std::unique_ptr<std::atomic<uint8_t>[]> waiting(new std::atomic<uint8_t>[code_.size()]);
+        size_t next_deque = 0;
+        for (uint32_t i = 0; i < code_.size(); i++)
+        {
+            const bool leaf = (code_[i].op_ == OP_CONST) || (code_[i].op_ == OP_HUMN);
+            waiting[i].store(leaf ? 0 : 2, std::memory_order_relaxed);
+            if (leaf)
+            {
+                ready[next_deque].slots_.push_back(i);
+                next_deque = (next_deque + 1) % threads;
+            }
         }
-        else
+        std::atomic<size_t> remaining{code_.size()};
+
+        auto worker = [&](const size_t id) {
+            ReadyDeque &own = ready[id];
+            while (remaining.load(std::memory_order_acquire))
+            {
+                std::optional<uint32_t> slot;
+                {
+                    std::lock_guard<std::mutex> l(own.lock_);
+                    if (own.slots_.size())
+                    {
+                        slot = own.slots_.back();
+                        own.slots_.pop_back();
+                    }
+                }
+                for (size_t victim = 1; !slot && (victim < threads); victim++)
+                {
+                    ReadyDeque &other = ready[(id + victim) % threads];
+                    std::lock_guard<std::mutex> l(other.lock_);
+                    if (other.slots_.size())
+                    {
+                        slot = other.slots_.front();
+                        other.slots_.pop_front();
+                    }
+                }
+                if (!slot)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                values_[*slot] = execute(code_[*slot]);
+                for (uint32_t p = parent_start_[*slot]; p < parent_start_[*slot + 1]; p++)
+                {
+                    const uint32_t parent = parents_[p];
+                    if (waiting[parent].fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    {
+                        std::lock_guard<std::mutex> l(own.lock_);
+                        own.slots_.push_back(parent);
+                    }
+                }
+                remaining.fetch_sub(1, std::memory_order_acq_rel);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; t++)
         {
-            right_node_->set_subvalue(left_node_->process() - input_value);
+            workers.emplace_back(worker, t);
         }
+        worker(0);
+        for (auto &w : workers)
+        {
+            w.join();
+        }
+        pending_ = decltype(pending_){};
+        std::fill(queued_.begin(), queued_.end(), false);
     }
-};
-class MultiplyNode : public ArithmeticNode
-{
-public: 
-    MultiplyNode(const std::string &left_label, const std::string &right_label)
-    : ArithmeticNode(left_label, right_label)
+
+    // Change the constant of a leaf node from MonkeyGraph::nodes(). Only
+    // the leaf itself is updated here - its ancestors are queued and
+    // brought up to date by the next refresh(), so any number of updates
+    // can be batched together. Returns false if node isn't a leaf used by
+    // this program.
+    bool set_leaf(const uint32_t node, const long long value)
     {
+        if ((node >= slots_.size()) || (slots_[node] == no_slot))
+        {
+            return false;
+        }
+        const uint32_t slot = slots_[node];
+        Instruction &ins = code_[slot];
+        if ((ins.op_ != OP_CONST) && (ins.op_ != OP_HUMN))
+        {
+            return false;
+        }
+        ins.value_ = value;
+        if (values_[slot] != value)
+        {
+            values_[slot] = value;
+            queue_parents(slot);
+        }
+        return true;
     }
-    long long process(void) const
+
+    // Recompute every ancestor of the leaves changed since the last
+    // evaluate() or refresh(). Slots are in postorder so a parent's slot is
+    // always larger than its children's : popping the smallest queued slot
+    // first means each node is recomputed once, after all of its changed
+    // inputs, however many updated leaves it sits above. Propagation stops
+    // early wherever a recomputed value comes out unchanged. Stops at the
+    // first division by zero (or the one overflowing division), reporting
+    // that node - values are left part updated.
+    struct RefreshResult
     {
-        return left_node_->process() * right_node_->process();
-    }
-    void set_subvalue(const long long input_value) const override
+        size_t recomputed_{0};
+        std::optional<uint32_t> failed_node_; // MonkeyGraph node
+    };
+    RefreshResult refresh(void)
     {
-        if (left_is_humn())
+        RefreshResult result;
+        while (pending_.size())
         {
-            left_node_->set_subvalue(input_value / right_node_->process());
+            const uint32_t slot = pending_.top();
+            pending_.pop();
+            queued_[slot] = false;
+            result.recomputed_ += 1;
+            const Instruction &ins = code_[slot];
+            if ((ins.op_ == OP_DIVIDE) &&
+                ((values_[ins.rhs_] == 0) ||
+                 ((values_[ins.lhs_] == std::numeric_limits<long long>::min()) && (values_[ins.rhs_] == -1))))
+            {
+                result.failed_node_ = node_of_slot_[slot];
+                return result;
+            }
+            const long long value = execute(code_[slot]);
+            if (value != values_[slot])
+            {
+                values_[slot] = value;
+                queue_parents(slot);
+            }
         }
-        else
+        return result;
+    }
+
+    // Result of evaluate_as() : root's value, or the MonkeyGraph node
+    // whose operation the policy rejected
+    template <typename Value>
+    struct EvaluateResult
+    {
+        std::optional<Value> value_;
+        uint32_t failed_node_{0};
+    };
+
+    // Evaluate into a separate array of Policy::Value, leaving values_
+    // alone, stopping at the first operation the policy rejects
+    template <typename Policy>
+    EvaluateResult<typename Policy::Value> evaluate_as(void) const
+    {
+        using Value = typename Policy::Value;
+        std::vector<Value> values(code_.size());
+        for (size_t i = 0; i < code_.size(); i++)
         {
-            right_node_->set_subvalue(input_value / left_node_->process());
+            const Instruction &ins = code_[i];
+            bool ok = true;
+            switch (ins.op_)
+            {
+            case OP_CONST:
+            case OP_HUMN:
+                values[i] = ins.value_;
+                break;
+            case OP_ADD:
+                ok = Policy::add(values[ins.lhs_], values[ins.rhs_], values[i]);
+                break;
+            case OP_SUBTRACT:
+                ok = Policy::subtract(values[ins.lhs_], values[ins.rhs_], values[i]);
+                break;
+            case OP_MULTIPLY:
+                ok = Policy::multiply(values[ins.lhs_], values[ins.rhs_], values[i]);
+                break;
+            case OP_DIVIDE:
+                ok = Policy::divide(values[ins.lhs_], values[ins.rhs_], values[i]);
+                break;
+            }
+            if (!ok)
+            {
+                return EvaluateResult<Value>{std::nullopt, node_of_slot_[i]};
+            }
         }
+        return EvaluateResult<Value>{values.back(), 0};
     }
-};
-class DivideNode : public ArithmeticNode
-{
-public: 
-    DivideNode(const std::string &left_label, const std::string &right_label)
-    : ArithmeticNode(left_label, right_label)
+
+    // A MonkeyGraph node on a cycle, if the constructor found one, in which
+    // case the program is incomplete and mustn't be used
+    std::optional<uint32_t> cycle(void) const
     {
+        return cycle_;
     }
-    long long process(void) const
+
+    // Value of a node from MonkeyGraph::nodes()
+    long long value(const uint32_t node) const
     {
-        return left_node_->process() / right_node_->process();
+        return values_[slots_[node]];
     }
-    void set_subvalue(const long long input_value) const override
+
+    // Find the humn value which makes both sides of root equal. Starting
+    // from root, each step inverts one operation to get the value the humn
+    // side has to produce, using the cached value of the other side, so only
+    // the path down to humn is visited. Requires evaluate() to have been
+    // run, and returns nullopt unless exactly one side of each operation on
+    // the way down depends on humn, or if inverting a step would divide by
+    // zero (humn multiplied by zero, or dividing into a target of zero).
+    std::optional<long long> solve_humn(void) const
     {
-        if (left_is_humn())
+        size_t slot = code_.size() - 1;
+        std::optional<long long> target;
+        while (code_[slot].op_ != OP_HUMN)
         {
-            left_node_->set_subvalue(input_value * right_node_->process());
-        }
-        else
-        {
-            right_node_->set_subvalue(left_node_->process() / input_value);
+            const Instruction &ins = code_[slot];
+            if ((ins.op_ == OP_CONST) || (depends_on_humn_[ins.lhs_] == depends_on_humn_[ins.rhs_]))
+            {
+                return std::nullopt;
+            }
+            const bool humn_left = depends_on_humn_[ins.lhs_];
+            const long long other = values_[humn_left ? ins.rhs_ : ins.lhs_];
+            if (!target)
+            {
+                // root : both sides must be equal
+                target = other;
+            }
+            else
+            {
+                switch (ins.op_)
+                {
+                case OP_ADD:
+                    target = *target - other;
+                    break;
+                case OP_SUBTRACT:
+                    target = humn_left ? (*target + other) : (other - *target);
+                    break;
+                case OP_MULTIPLY:
+                    if (other == 0)
+                    {
+                        return std::nullopt;
+                    }
+                    target = *target / other;
+                    break;
+                case OP_DIVIDE:
+                    if (!humn_left && (*target == 0))
+                    {
+                        return std::nullopt;
+                    }
+                    target = humn_left ? (*target * other) : (other / *target);
+                    break;
+                }
+            }
+            slot = humn_left ? ins.lhs_ : ins.rhs_;
         }
+        return target;
     }
-};
-class RootNode : public ArithmeticNode
-{
-public: 
-    RootNode(const std::string &left_label, const std::string &right_label)
-    : ArithmeticNode(left_label, right_label)
+
+    // Result of solve_humn_linear() : humn, or why it couldn't be found
+    struct LinearSolution
     {
-    }
-    long long process(void) const
+        std::optional<Rational> humn_;
+        const char *failure_{nullptr};
+    };
+
+    // Solve for humn by carrying every value as a linear function of humn,
+    // a * humn + b, with exact rational coefficients. A single bottom up
+    // pass gives both sides of root in that form, and equating them gives
+    // humn directly. Unlike solve_humn() nothing is truncated by integer
+    // division, and humn may be used any number of times. Fails if the
+    // expression isn't linear in humn (humn multiplied by itself or
+    // dividing by an expression involving humn), the sides never meet, or
+    // a coefficient outgrows 128 bits.
+    LinearSolution solve_humn_linear(void) const
     {
-        std::cout << left_node_->process() << " " << right_node_->process() << std::endl;
-        return 0;
+        constexpr const char *not_linear = "root has no unique solution linear in humn";
+        constexpr const char *overflow = "the linear solution for humn overflows 128 bit fractions";
+        struct Linear
+        {
+            Rational a_;
+            Rational b_;
+        };
+        std::vector<Linear> linear(code_.size());
+        for (size_t i = 0; i < code_.size(); i++)
+        {
+            const Instruction &ins = code_[i];
+            switch (ins.op_)
+            {
+            case OP_CONST:
+                linear[i] = Linear{Rational(0), Rational(ins.value_)};
+                break;
+            case OP_HUMN:
+                linear[i] = Linear{Rational(1), Rational(0)};
+                break;
+            case OP_ADD:
+                linear[i] = Linear{linear[ins.lhs_].a_ + linear[ins.rhs_].a_, linear[ins.lhs_].b_ + linear[ins.rhs_].b_};
+                break;
+            case OP_SUBTRACT:
+                linear[i] = Linear{linear[ins.lhs_].a_ - linear[ins.rhs_].a_, linear[ins.lhs_].b_ - linear[ins.rhs_].b_};
+                break;
+            case OP_MULTIPLY:
+            {
+                const Linear &l = linear[ins.lhs_];
+                const Linear &r = linear[ins.rhs_];
+                if (!l.a_.is_zero() && !r.a_.is_zero())
+                {
+                    return LinearSolution{std::nullopt, not_linear};
+                }
+                linear[i] = Linear{l.a_ * r.b_ + r.a_ * l.b_, l.b_ * r.b_};
+                break;
+            }
+            case OP_DIVIDE:
+            {
+                const Linear &l = linear[ins.lhs_];
+                const Linear &r = linear[ins.rhs_];
+                if (!r.a_.is_zero() || r.b_.is_zero())
+                {
+                    return LinearSolution{std::nullopt, not_linear};
+                }
+                linear[i] = Linear{l.a_ / r.b_, l.b_ / r.b_};
+                break;
+            }
+            }
+            if (linear[i].a_.overflow() || linear[i].b_.overflow())
+            {
+                return LinearSolution{std::nullopt, overflow};
+            }
+        }
+
+        // root : left.a * humn + left.b == right.a * humn + right.b
+        const Instruction &root = code_.back();
+        const Linear &l = linear[root.lhs_];
+        const Linear &r = linear[root.rhs_];
+        const Rational a = l.a_ - r.a_;
+        if ((root.op_ == OP_CONST) || (root.op_ == OP_HUMN))
+        {
+            return LinearSolution{std::nullopt, not_linear};
+        }
+        if (a.overflow())
+        {
+            return LinearSolution{std::nullopt, overflow};
+        }
+        if (a.is_zero())
+        {
+            return LinearSolution{std::nullopt, not_linear};
+        }
+        const Rational humn = (r.b_ - l.b_) / a;
+        if (humn.overflow())
+        {
+            return LinearSolution{std::nullopt, overflow};
+        }
+        return LinearSolution{humn, nullptr};
     }
-    void set_subvalue(const long long input_value) const override
+
+private:
+    long long execute(const Instruction &ins) const
     {
-        if (left_is_humn())
+        switch (ins.op_)
         {
-            left_node_->set_subvalue(right_node_->process());
+        case OP_CONST:
+        case OP_HUMN:
+            return ins.value_;
+        case OP_ADD:
+            return values_[ins.lhs_] + values_[ins.rhs_];
+        case OP_SUBTRACT:
+            return values_[ins.lhs_] - values_[ins.rhs_];
+        case OP_MULTIPLY:
+            return values_[ins.lhs_] * values_[ins.rhs_];
+        case OP_DIVIDE:
+            return values_[ins.lhs_] / values_[ins.rhs_];
         }
-        else
+        return 0;
+    }
+
+    void queue_parents(const uint32_t slot)
+    {
+        for (uint32_t p = parent_start_[slot]; p < parent_start_[slot + 1]; p++)
         {
-            right_node_->set_subvalue(left_node_->process());
+            const uint32_t parent = parents_[p];
+            if (!queued_[parent])
+            {
+                queued_[parent] = true;
+                pending_.push(parent);
+            }
         }
     }
+
+    static constexpr uint32_t no_slot = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> slots_; // MonkeyGraph node index -> instruction
+    std::vector<uint32_t> node_of_slot_; // and back again
+    std::optional<uint32_t> cycle_;
+    std::vector<Instruction> code_;
+    std::vector<long long> values_;
+    std::vector<bool> depends_on_humn_;
+    std::vector<uint32_t> parent_start_;
+    std::vector<uint32_t> parents_;
+    // Instructions waiting to be recomputed by refresh(), smallest first
+    std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>> pending_;
+    std::vector<bool> queued_;
 };
 
 int main(int argc, char **argv)
 {
-    std::ifstream istream(argv[1], std::ifstream::in);
-    std::string line;
-
-    SymTab sym_tab;
-    while (getline(istream, line))
+    MappedFile file(argv[1]);
+    if (!file.valid())
+    {
+        std::cerr << "Can't read " << argv[1] << std::endl;
+        return 1;
+    }
+    MonkeyGraph graph;
+    if (!graph.parse(file.begin(), file.end()))
+    {
+        return 1;
+    }
+    const uint32_t root = graph.find("root");
+    if (root == MonkeyGraph::no_node)
+    {
+        std::cerr << "No root monkey" << std::endl;
+        return 1;
+    }
+    Program program(graph.nodes(), root);
+    if (program.cycle())
     {
-        if (line.substr(0,4) == "humn")
+        std::cerr << "Cycle at monkey " << name_string(graph.nodes()[*program.cycle()].name_) << std::endl;
+        return 1;
+    }
+
+    // p1 input.txt <unchecked|checked|wide>
+    // Evaluates root using the given arithmetic policy
+    auto report = [&]<typename Policy>(Policy) {
+        const auto result = program.evaluate_as<Policy>();
+        if (result.value_)
         {
-            sym_tab[line.substr(0,4)] = std::make_shared<HumnNode>();
+            std::cout << "root (" << Policy::name << ") = " << to_string(*result.value_) << std::endl;
+            return 0;
         }
-        else if (isdigit(line[6]))
+        std::cout << "root (" << Policy::name << ") : overflow or division by zero at monkey "
+                  << name_string(graph.nodes()[result.failed_node_].name_) << std::endl;
+        return 1;
+    };
+    const std::string mode((argc > 2) ? argv[2] : "");
+    if (mode == "unchecked")
+    {
+        return report(UncheckedPolicy{});
+    }
+    if (mode == "checked")
+    {
+        return report(CheckedPolicy{});
+    }
+    if (mode == "wide")
+    {
+        return report(WidePolicy{});
+    }
+
+    // p1 input.txt parallel [threads]
+    // Evaluates with a thread pool, by default or for 0 one thread per core
+    if ((argc > 2) && (std::string(argv[2]) == "parallel"))
+    {
+        constexpr unsigned max_threads = 1024;
+        unsigned threads = 0;
+        if (argc > 3)
         {
-            sym_tab[line.substr(0,4)] = std::make_shared<LeafNode>(atoi(&line[6]));
+            const char *end = argv[3] + strlen(argv[3]);
+            const auto [ptr, ec] = std::from_chars(argv[3], end, threads);
+            if ((ec != std::errc()) || (ptr != end) || (threads > max_threads))
+            {
+                std::cerr << "Thread count " << argv[3] << " : expected 0 to " << max_threads << std::endl;
+                return 1;
+            }
         }
-        else if (line.substr(0,4) == "root")
+        if (threads == 0)
         {
-            sym_tab[line.substr(0,4)] = std::make_shared<RootNode>(line.substr(6,4), line.substr(13,4));
+            threads = std::max(1U, std::thread::hardware_concurrency());
         }
-        else if (line[11] == '+')
+        program.evaluate_parallel(threads);
+    }
+    else
+    {
+        program.evaluate();
+    }
+    std::cout << "root = " << program.value(root) << std::endl;
+
+    // p1 input.txt set name value [name value ...]
+    // Reports root again after changing the given leaf monkeys' numbers
+    if ((argc > 2) && (std::string(argv[2]) == "set"))
+    {
+        for (int i = 3; (i + 1) < argc; i += 2)
         {
-            sym_tab[line.substr(0,4)] = std::make_shared<AddNode>(line.substr(6,4), line.substr(13,4));
+            const std::string name(argv[i]);
+            const bool valid_name = (name.size() == 4) && std::all_of(name.begin(), name.end(), [](const char c)
+                                                                      { return (c >= 'a') && (c <= 'z'); });
+            const char *value_end = argv[i + 1] + strlen(argv[i + 1]);
+            long long value = 0;
+            const auto [ptr, ec] = std::from_chars(argv[i + 1], value_end, value);
+            if ((ec != std::errc()) || (ptr != value_end) || (ptr == argv[i + 1]))
+            {
+                std::cerr << "Can't set " << name << " to " << argv[i + 1] << " : expected a number" << std::endl;
+                return 1;
+            }
+            if (!valid_name || !program.set_leaf(graph.find(name.c_str()), value))
+            {
+                std::cerr << name << " isn't a monkey which yells a number" << std::endl;
+                return 1;
+            }
         }
-        else if (line[11] == '-')
+        const auto result = program.refresh();
+        if (result.failed_node_)
         {
-            sym_tab[line.substr(0,4)] = std::make_shared<SubtractNode>(line.substr(6,4), line.substr(13,4));
+            std::cout << "root : overflow or division by zero at monkey "
+                      << name_string(graph.nodes()[*result.failed_node_].name_) << std::endl;
+            return 1;
         }
-        else if (line[11] == '*')
+        std::cout << "root = " << program.value(root) << " (" << result.recomputed_ << " monkeys recomputed)" << std::endl;
+        return 0;
+    }
+    // "linear" solves with exact rational arithmetic instead of inverting
+    // each operation on the path down to humn
+    if ((argc > 2) && (std::string(argv[2]) == "linear"))
+    {
+        const auto solution = program.solve_humn_linear();
+        if (solution.humn_)
         {
-            sym_tab[line.substr(0,4)] = std::make_shared<MultiplyNode>(line.substr(6,4), line.substr(13,4));
+            std::cout << "humn = " << *solution.humn_ << std::endl;
         }
-        else if (line[11] == '/')
+        else
         {
-            sym_tab[line.substr(0,4)] = std::make_shared<DivideNode>(line.substr(6,4), line.substr(13,4));
+            std::cout << solution.failure_ << std::endl;
         }
+        return 0;
+    }
+    const auto humn = program.solve_humn();
+    if (humn)
+    {
+        std::cout << "humn = " << *humn << std::endl;
     }
-    for (auto &s : sym_tab)
+    else
     {
-        s.second->build_tree(sym_tab);
+        std::cout << "humn can't be solved for by inverting the path to it" << std::endl;
     }
- //   std::cout << sym_tab.at("root")->process() << std::endl;
-    sym_tab.at("root")->set_subvalue(0);
     return 0;
 }
\ No newline at end of file